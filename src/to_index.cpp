@@ -23,6 +23,8 @@
 // the compiler does not optimize the loops if I write more compactly. So be it.
 
 #include <stdint.h>
+#include <climits>
+#include <cstring>
 #include <cmath>
 #include <vector>
 #include <string>
@@ -30,43 +32,197 @@
 #include <memory>
 #include <R.h>
 #include <Rinternals.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+
+#if R_VERSION < R_Version(3, 6, 0)
+// Altrep.h is not C++ compatible before R 3.6.0
+#define class klass
+extern "C" {
+#include <R_ext/Altrep.h>
+}
+#undef class
+#else
+#include <R_ext/Altrep.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using std::vector;
 
 namespace indexthis {
 
-enum {T_INT, T_DBL_INT, T_DBL, T_STR};
+enum {T_INT, T_DBL_INT, T_DBL, T_STR, T_INT64};
+
+inline uint32_t mix_seed_64(uint64_t value, uint32_t seed){
+  // murmur3 64 bits finalizer, the seed being mixed in first: all the 64 bits 
+  // and the seed affect the 32 bits kept
+  value ^= static_cast<uint64_t>(seed) * 0x9e3779b97f4a7c15ULL;
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return static_cast<uint32_t>(value >> 32);
+}
 
-inline int double_to_uint32(const double &x){
+// seed: if 0, the 64 bits are folded into 32 bits (fast)
+//       otherwise they are mixed with the seed before being cut to 32 bits: 
+//       with a fold, the values with the same fold would collide whatever the seed
+inline int double_to_uint32(const double &x, uint32_t seed = 0){
+  // -0 and 0 are equal: they must have the same hash
+  const double x_pos = x + 0.0;
+  if(seed != 0){
+    uint64_t y;
+    std::memcpy(&y, &x_pos, sizeof(y));
+    return mix_seed_64(y, seed);
+  }
   uint32_t y[2];
-  std::memcpy(y, &x, sizeof(y));
+  std::memcpy(y, &x_pos, sizeof(y));
   return y[0] + y[1];
 }
 
+inline uint32_t int64_to_uint32(int64_t x, uint32_t seed = 0){
+  if(seed != 0){
+    return mix_seed_64(static_cast<uint64_t>(x), seed);
+  }
+  return static_cast<uint32_t>(x ^ (x >> 32));
+}
+
 inline int power_of_two(double x){
   return std::ceil(std::log2(x + 1));
 }
 
-inline uint32_t hash_single(uint32_t value, int shifter){
+inline uint32_t mix_seed(uint32_t value, uint32_t seed){
+  // murmur3 finalizer: every bit of the input affects the top bits
+  value ^= seed;
+  value ^= value >> 16;
+  value *= 0x85ebca6b;
+  value ^= value >> 13;
+  value *= 0xc2b2ae35;
+  value ^= value >> 16;
+  return value;
+}
+
+// seed: if 0, plain multiplicative hashing
+//       otherwise the values are mixed with the seed first. This is slower but 
+//       robust to structured inputs (e.g. multiples of a large power of two)
+inline uint32_t hash_single(uint32_t value, int shifter, uint32_t seed = 0){
+  if(seed != 0){
+    return mix_seed(value, seed) >> (32 - shifter);
+  }
   return (3141592653U * value >> (32 - shifter));
 }
 
-inline uint32_t hash_double(uint32_t v1, uint32_t v2, int shifter){
+inline uint32_t hash_double(uint32_t v1, uint32_t v2, int shifter, uint32_t seed = 0){
+  if(seed != 0){
+    return mix_seed((3141592653U * v1) ^ v2, seed) >> (32 - shifter);
+  }
   return (((3141592653U * v1) ^ (3141592653U * v2)) >> (32 - shifter));
 }
 
+// Probes longer than MAX_PROBE_LENGTH mean that the input is pathological for 
+// the hash function (long clusters in the table, the algorithm degrades to O(n**2)). 
+// In that case the engines stop and we start over with a seeded hash.
+#define MAX_PROBE_LENGTH 256
+
+// the probes of the hash tables are done by blocks of rows:
+// 1) the rows of the block are hashed and their slots are prefetched
+// 2) the observations already in these slots are prefetched
+// 3) the rows are resolved in order (so the order of first occurrence is kept)
+// The latency of the cache misses is then paid once per block instead of once per row,
+// which matters when the table does not fit in the cache.
+#define PROBE_BLOCK 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)
+#endif
+
+inline int range_to_int(double range){
+  // the range of an int vector may not fit in an int (e.g. -2e9 to 2e9)
+  // it is then capped: such a vector is never dense
+  return range < INT_MAX ? static_cast<int>(range) : INT_MAX;
+}
+
 inline bool is_equal_dbl(double x, double y){
   return std::isnan(x) ? std::isnan(y) : x == y;
 }
 
+inline bool is_known_sorted(SEXP x){
+  // R keeps track of the sortedness of some ALTREP vectors (compact sequences
+  // like 1:n, or the results of sort()): KNOWN_UNSORTED and UNKNOWN_SORTEDNESS
+  // are the only values for which equal elements may not be contiguous
+  // NOTA: integer64 vectors are stored in doubles but their bits are not doubles: 
+  // the comparisons of the sorted algorithm would not be valid
+  int sortedness = UNKNOWN_SORTEDNESS;
+  if(TYPEOF(x) == INTSXP){
+    sortedness = INTEGER_IS_SORTED(x);
+  } else if(TYPEOF(x) == REALSXP && !Rf_inherits(x, "integer64")){
+    sortedness = REAL_IS_SORTED(x);
+  }
+  
+  return sortedness != UNKNOWN_SORTEDNESS && sortedness != KNOWN_UNSORTED;
+}
+
 // Class very useful to pass around the data on R vectors 
 class r_vector {
   r_vector() = delete;
   
   SEXP x_conv;
   
+  template<typename T>
+  T *select_rows(T *px, const vector<int> *p_rows){
+    // p_rows: the selected rows (0-based), null if all rows are used
+    // returns px if there is no row selection, otherwise the selected 
+    // rows are gathered into own_data, in a single pass
+    if(!p_rows){
+      return px;
+    }
+    
+    const vector<int> &rows = *p_rows;
+    const size_t n_rows = rows.size();
+    own_data.resize(sizeof(T) * n_rows);
+    T *px_rows = (T *) own_data.data();
+    for(size_t i=0 ; i<n_rows ; ++i){
+      px_rows[i] = px[rows[i]];
+    }
+    
+    return px_rows;
+  }
+  
+  double *bin_values(double *px, bool is_own, double bin_width, int bin_digits){
+    // the values are replaced by their bins:
+    // - floor(x / bin_width) if bin_width > 0
+    // - round(x * 10**bin_digits) otherwise
+    // is_own: whether px already points to own_data, the bins are then computed in place
+    
+    double *px_bin = px;
+    if(!is_own){
+      own_data.resize(sizeof(double) * n);
+      px_bin = (double *) own_data.data();
+    }
+    
+    if(bin_width > 0){
+      for(int i=0 ; i<n ; ++i){
+        px_bin[i] = std::floor(px[i] / bin_width);
+      }
+    } else {
+      const double mult = std::pow(10.0, bin_digits);
+      for(int i=0 ; i<n ; ++i){
+        px_bin[i] = std::nearbyint(px[i] * mult);
+      }
+    }
+    
+    return px_bin;
+  }
+  
 public:
-  r_vector(SEXP);
+  r_vector(SEXP x, const vector<int> *p_rows = nullptr, double bin_width = 0, 
+           int bin_digits = NA_INTEGER);
   
   // removing the copy and assignment
   // r_vector(const r_vector &) = delete;
@@ -86,7 +242,9 @@ public:
   
   // if a non numeric non character vector has been turned into character
   // we need to keep track of protection
+  // n_conv: length of the converted vector (only the selected rows when possible)
   bool is_protect = false;
+  int n_conv = 0;
   
   // this is only used in the quick ints algorithm
   // for factors and bool we assume there are NAs since we don't traverse the data
@@ -98,6 +256,17 @@ public:
   int *px_int = (int *) nullptr;
   double *px_dbl = (double *) nullptr;
   intptr_t *px_intptr = (intptr_t *) nullptr;
+  int64_t *px_int64 = (int64_t *) nullptr;
+  
+  // integer64 (bit64): if the range fits into 32 bits, the vector is turned 
+  // into int offsets from the min value (type T_INT), otherwise it is T_INT64
+  bool is_int64 = false;
+  int64_t int64_min = 0;
+  vector<int> int64_offsets;
+  
+  // data owned by the vector, the pointers refer to it:
+  // the selected rows (row selection) and/or the bins of doubles (binning)
+  vector<char> own_data;
   
   ~r_vector(){
     if(is_protect){
@@ -107,24 +276,85 @@ public:
   
 };
 
-r_vector::r_vector(SEXP x){
+r_vector::r_vector(SEXP x, const vector<int> *p_rows, double bin_width, int bin_digits){
+  // p_rows: if not null, only the rows in p_rows (0-based) are considered, 
+  //         the vector is then of length p_rows->size()
+  // bin_width, bin_digits: only for doubles, the values are replaced by their bins, 
+  //                        see bin_values. No binning if bin_width is not positive 
+  //                        and bin_digits is NA.
   
-  int n = Rf_length(x);
+  int n = p_rows ? p_rows->size() : Rf_length(x);
   this->n = n;
   
   bool IS_INT = false;
   if(TYPEOF(x) == STRSXP){
     // character
     this->type = T_STR;
-    this->px_intptr = (intptr_t *) STRING_PTR_RO(x);
+    this->px_intptr = select_rows((intptr_t *) STRING_PTR_RO(x), p_rows);
     
   } else if(Rf_isNumeric(x) || Rf_isFactor(x) || TYPEOF(x) == LGLSXP){
       
-    if(TYPEOF(x) == REALSXP){
+    if(TYPEOF(x) == REALSXP && Rf_inherits(x, "integer64")){
+      // integer64: the doubles are int64_t in disguise, NA is INT64_MIN
+      this->is_int64 = true;
+      int64_t *px = select_rows((int64_t *) REAL(x), p_rows);
+      
+      int i_start = 0;
+      while(i_start < n && px[i_start] == INT64_MIN){
+        ++i_start;
+      }
+      
+      bool any_na = i_start > 0;
+      int64_t x_min = 0, x_max = 0;
+      if(i_start < n){
+        x_min = px[i_start];
+        x_max = px[i_start];
+        
+        for(int i=i_start ; i<n ; ++i){
+          if(px[i] > x_max){
+            x_max = px[i];
+          } else if(px[i] < x_min){
+            if(px[i] == INT64_MIN){
+              any_na = true;
+            } else {
+              x_min = px[i];
+            }
+          }
+        }
+      }
+      
+      // unsigned to avoid overflows
+      const uint64_t range = static_cast<uint64_t>(x_max) - static_cast<uint64_t>(x_min);
+      if(range < INT_MAX - 2){
+        // small range: the values become int offsets, which can use the fast ints
+        IS_INT = true;
+        this->int64_offsets.resize(n);
+        int *p_offsets = this->int64_offsets.data();
+        for(int i=0 ; i<n ; ++i){
+          p_offsets[i] = px[i] == INT64_MIN ? NA_INTEGER : static_cast<int>(px[i] - x_min);
+        }
+        
+        this->px_int = p_offsets;
+        this->type = T_INT;
+        this->int64_min = x_min;
+        this->any_na = any_na;
+        this->x_min = 0;
+        // +1 for the NAs
+        this->x_range = range + 2;
+      } else {
+        this->px_int64 = px;
+        this->type = T_INT64;
+      }
+      
+    } else if(TYPEOF(x) == REALSXP){
       // we check if the underlying structure is int
-      this->px_dbl = REAL(x);
+      double *px = select_rows(REAL(x), p_rows);
+      if(bin_width > 0 || bin_digits != NA_INTEGER){
+        // the bins are often integers in a small range => dense algorithm
+        px = bin_values(px, p_rows != nullptr, bin_width, bin_digits);
+      }
+      this->px_dbl = px;
       IS_INT = true;
-      double *px = REAL(x);
       double x_min = 0, x_max = 0, x_tmp;
       
       // taking care of NA corner cases
@@ -158,17 +388,17 @@ r_vector::r_vector(SEXP x){
 
       this->x_min = static_cast<int>(x_min);
       // +1 for the NAs
-      this->x_range = x_max - x_min + 2;
+      this->x_range = range_to_int(x_max - x_min + 2);
       
       this->type = IS_INT ? T_DBL_INT : T_DBL;
     } else {
       // logical, factor and integer are all integers
       IS_INT = true;
-      this->px_int = INTEGER(x);
+      this->px_int = select_rows(INTEGER(x), p_rows);
       this->type = T_INT;
       
       if(TYPEOF(x) == INTSXP){
-        int *px = INTEGER(x);
+        int *px = this->px_int;
         int x_min = 0, x_max = 0, x_tmp;
         
         // taking care of NA corner cases
@@ -200,7 +430,7 @@ r_vector::r_vector(SEXP x){
         this->any_na = any_na;
         this->x_min = x_min;
         // +1 for the NAs
-        this->x_range = x_max - x_min + 2;
+        this->x_range = range_to_int(static_cast<double>(x_max) - x_min + 2);
       } else if(TYPEOF(x) == LGLSXP){
         this->x_min = 0;
         // 0, 1, NA
@@ -228,8 +458,36 @@ r_vector::r_vector(SEXP x){
     if(TYPEOF(x) == CHARSXP || TYPEOF(x) == LGLSXP || TYPEOF(x) == INTSXP || 
       TYPEOF(x) == REALSXP || TYPEOF(x) == CPLXSXP || TYPEOF(x) == STRSXP || TYPEOF(x) == RAWSXP){
   
+      // with a row selection, complex and raw vectors are gathered first, so that 
+      // only the selected rows are converted
+      SEXP x_rows = x;
+      bool is_gathered = p_rows && (TYPEOF(x) == CPLXSXP || TYPEOF(x) == RAWSXP);
+      if(is_gathered){
+        const vector<int> &rows = *p_rows;
+        x_rows = PROTECT(Rf_allocVector(TYPEOF(x), n));
+        if(TYPEOF(x) == CPLXSXP){
+          const Rcomplex *px = COMPLEX(x);
+          Rcomplex *px_rows = COMPLEX(x_rows);
+          for(int i=0 ; i<n ; ++i){
+            px_rows[i] = px[rows[i]];
+          }
+        } else {
+          const Rbyte *px = RAW(x);
+          Rbyte *px_rows = RAW(x_rows);
+          for(int i=0 ; i<n ; ++i){
+            px_rows[i] = px[rows[i]];
+          }
+        }
+        Rf_setAttrib(x_rows, R_ClassSymbol, Rf_getAttrib(x, R_ClassSymbol));
+      }
+      
       int any_error;
-      this->x_conv = PROTECT(R_tryEval(Rf_lang2(Rf_install("as.character"), x), R_GlobalEnv, &any_error));
+      this->x_conv = PROTECT(R_tryEval(Rf_lang2(Rf_install("as.character"), x_rows), R_GlobalEnv, &any_error));
+      if(is_gathered){
+        // only x_conv remains protected, as expected by the destructor
+        UNPROTECT(2);
+        PROTECT(this->x_conv);
+      }
       this->is_protect = true;
       
       if(any_error){
@@ -240,7 +498,11 @@ r_vector::r_vector(SEXP x){
       
       // conversion succeeded
       this->type = T_STR;
+      this->n_conv = Rf_length(this->x_conv);
       this->px_intptr = (intptr_t *) STRING_PTR_RO(this->x_conv);
+      if(!is_gathered){
+        this->px_intptr = select_rows(this->px_intptr, p_rows);
+      }
       
     } else {
       this->is_error = true;
@@ -266,8 +528,98 @@ SEXP std_string_to_r_string(std::vector<std::string> x){
   return res;
 }
 
-void general_type_to_index_single(r_vector *x, int *__restrict p_index, int &n_groups,
-                                  vector<int> &vec_first_obs, bool is_final){
+SEXP error_to_r_list(const std::string &error_msg){
+  // errors are not thrown from C: we return list(is_error = TRUE, error_msg)
+  // and the R function is in charge of the error
+  
+  SEXP sexp_is_error = PROTECT(Rf_ScalarLogical(1));
+  SEXP sexp_error_msg = PROTECT(std_string_to_r_string({error_msg}));
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(res, 0, sexp_is_error);
+  SET_VECTOR_ELT(res, 1, sexp_error_msg);
+  
+  // names
+  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"is_error", "error_msg"}));
+  UNPROTECT(3);
+  
+  return res;
+}
+
+inline uint32_t value_to_uint32(const r_vector &x, size_t i, uint32_t seed = 0){
+  // the value of x[i] as a 32 bits integer, to be hashed
+  // seed: only used for 64 bits values, see int64_to_uint32
+  if(x.type == T_INT){
+    return x.px_int[i];
+  } else if(x.type == T_INT64){
+    return int64_to_uint32(x.px_int64[i], seed);
+  } else if(x.type == T_DBL_INT){
+    return std::isnan(x.px_dbl[i]) ? x.NA_value : static_cast<int>(x.px_dbl[i]);
+  } else if(x.type == T_DBL){
+    // all NAs/NaNs should lead to the same hash
+    return std::isnan(x.px_dbl[i]) ? 0 : double_to_uint32(x.px_dbl[i], seed);
+  }
+  
+  return x.px_intptr[i] & 0xffffffff;
+}
+
+inline bool is_same_value(const r_vector &x, size_t i, const r_vector &y, size_t j){
+  // x and y must be of the same kind: int, double (T_DBL or T_DBL_INT) or string
+  if(x.type == T_INT){
+    return x.px_int[i] == y.px_int[j];
+  } else if(x.type == T_INT64){
+    return x.px_int64[i] == y.px_int64[j];
+  } else if(x.type == T_STR){
+    return x.px_intptr[i] == y.px_intptr[j];
+  }
+  
+  return is_equal_dbl(x.px_dbl[i], y.px_dbl[j]);
+}
+
+inline bool is_same_row(const vector<std::shared_ptr<r_vector>> &all_vecs, size_t i, size_t j){
+  for(auto &&x : all_vecs){
+    if(!is_same_value(*x, i, *x, j)){
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+inline uint32_t hash_row(const vector<std::shared_ptr<r_vector>> &all_vecs, size_t i, 
+                         uint32_t seed = 0){
+  // hash of the full row i, to be cut to the first bits. seed: see hash_single
+  uint32_t value = 0;
+  for(auto &&x : all_vecs){
+    value = 3141592653U * (value ^ value_to_uint32(*x, i, seed));
+  }
+  
+  return seed == 0 ? value : mix_seed(value, seed);
+}
+
+// buffer of ints which can be reused across calls of the engines, 
+// to avoid allocating a new table for each vector
+class int_buffer {
+  vector<int> data;
+  
+public:
+  int *get_zeroed(size_t size){
+    if(data.size() < size){
+      data.assign(size, 0);
+    } else {
+      std::fill_n(data.data(), size, 0);
+    }
+    
+    return data.data();
+  }
+};
+
+bool general_type_to_index_single(r_vector *x, int *__restrict p_index, int &n_groups,
+                                  vector<int> &vec_first_obs, bool is_final, 
+                                  uint32_t seed, int max_probe, int_buffer *p_table = nullptr){
+  // seed: see hash_single
+  // max_probe: maximum probe length, 0 for no limit
+  // p_table: buffer for the table, if null a new table is allocated
+  // returns false if a probe was too long, in which case the index is invalid
   
   const size_t n = x->n;
   
@@ -287,71 +639,167 @@ void general_type_to_index_single(r_vector *x, int *__restrict p_index, int &n_g
   // - assume hash(value) leads to ID
   // - then hashed_obs_vec[ID] is the observation id of the first observation with that hash
   // - note that using an array makes the algo twice faster
-  int *hashed_obs_vec = new int[larger_n + 1];
-  std::fill_n(hashed_obs_vec, larger_n + 1, 0);
+  int_buffer local_table;
+  int *hashed_obs_vec = (p_table ? p_table : &local_table)->get_zeroed(larger_n + 1);
   
   const int *px_int = (int *) x->px_int;
   const double *px_dbl = (double *) x->px_dbl;
   const intptr_t *px_intptr = (intptr_t *) x->px_intptr;
+  const int64_t *px_int64 = (int64_t *) x->px_int64;
   
   const int x_type = x->type;
   
+  // the IDs of the current block of rows (see PROBE_BLOCK)
+  uint32_t block_id[PROBE_BLOCK];
+  
   int g = 0;
   uint32_t id = 0;
   int obs = 0;
   if(x_type == T_STR){
-    for(size_t i=0 ; i<n ; ++i){
+    for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+      const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
       
-      id = hash_single(px_intptr[i] & 0xffffffff, shifter);
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = hash_single(px_intptr[i] & 0xffffffff, shifter, seed);
+        block_id[i - i_start] = id;
+        PREFETCH(hashed_obs_vec + id);
+      }
       
-      bool does_exist = false;
-      while(hashed_obs_vec[id] != 0){
-        obs = hashed_obs_vec[id] - 1;
-        if(px_intptr[obs] == px_intptr[i]){
-          p_index[i] = p_index[obs];
-          does_exist = true;
-          break;
-        } else {
-          ++id;
-          if(id > larger_n){
-            id %= larger_n;
-          }
+      for(size_t b=0 ; b<i_end - i_start ; ++b){
+        obs = hashed_obs_vec[block_id[b]];
+        if(obs != 0){
+          PREFETCH(px_intptr + obs - 1);
+          PREFETCH(p_index + obs - 1);
         }
       }
-
-      if(!does_exist){
-        // hash never seen => ok
-        hashed_obs_vec[id] = i + 1;
-        p_index[i] = ++g;
-        if(is_final){
-          vec_first_obs.push_back(i + 1);
+      
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = block_id[i - i_start];
+        
+        bool does_exist = false;
+        int n_probe = 0;
+        while(hashed_obs_vec[id] != 0){
+          obs = hashed_obs_vec[id] - 1;
+          if(px_intptr[obs] == px_intptr[i]){
+            p_index[i] = p_index[obs];
+            does_exist = true;
+            break;
+          } else {
+            ++id;
+            if(id > larger_n){
+              id %= larger_n;
+            }
+            if(++n_probe == max_probe){
+              return false;
+            }
+          }
+        }
+        
+        if(!does_exist){
+          // hash never seen => ok
+          hashed_obs_vec[id] = i + 1;
+          p_index[i] = ++g;
+          if(is_final){
+            vec_first_obs.push_back(i + 1);
+          }
         }
       }
     }
   } else if(x_type == T_INT){
-    for(size_t i=0 ; i<n ; ++i){
-      id = hash_single(px_int[i], shifter);
+    for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+      const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
       
-      bool does_exist = false;
-      while(hashed_obs_vec[id] != 0){
-        obs = hashed_obs_vec[id] - 1;
-        if(px_int[obs] == px_int[i]){
-          p_index[i] = p_index[obs];
-          does_exist = true;
-          break;
-        } else {
-          ++id;
-          if(id > larger_n){
-            id %= larger_n;
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = hash_single(px_int[i], shifter, seed);
+        block_id[i - i_start] = id;
+        PREFETCH(hashed_obs_vec + id);
+      }
+      
+      for(size_t b=0 ; b<i_end - i_start ; ++b){
+        obs = hashed_obs_vec[block_id[b]];
+        if(obs != 0){
+          PREFETCH(px_int + obs - 1);
+          PREFETCH(p_index + obs - 1);
+        }
+      }
+      
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = block_id[i - i_start];
+        
+        bool does_exist = false;
+        int n_probe = 0;
+        while(hashed_obs_vec[id] != 0){
+          obs = hashed_obs_vec[id] - 1;
+          if(px_int[obs] == px_int[i]){
+            p_index[i] = p_index[obs];
+            does_exist = true;
+            break;
+          } else {
+            ++id;
+            if(id > larger_n){
+              id %= larger_n;
+            }
+            if(++n_probe == max_probe){
+              return false;
+            }
+          }
+        }
+        
+        if(!does_exist){
+          hashed_obs_vec[id] = i + 1;
+          p_index[i] = ++g;
+          if(is_final){
+            vec_first_obs.push_back(i + 1);
           }
         }
       }
-
-      if(!does_exist){
-        hashed_obs_vec[id] = i + 1;
-        p_index[i] = ++g;
-        if(is_final){
-          vec_first_obs.push_back(i + 1);
+    }
+  } else if(x_type == T_INT64){
+    for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+      const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
+      
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = hash_single(int64_to_uint32(px_int64[i], seed), shifter, seed);
+        block_id[i - i_start] = id;
+        PREFETCH(hashed_obs_vec + id);
+      }
+      
+      for(size_t b=0 ; b<i_end - i_start ; ++b){
+        obs = hashed_obs_vec[block_id[b]];
+        if(obs != 0){
+          PREFETCH(px_int64 + obs - 1);
+          PREFETCH(p_index + obs - 1);
+        }
+      }
+      
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = block_id[i - i_start];
+        
+        bool does_exist = false;
+        int n_probe = 0;
+        while(hashed_obs_vec[id] != 0){
+          obs = hashed_obs_vec[id] - 1;
+          if(px_int64[obs] == px_int64[i]){
+            p_index[i] = p_index[obs];
+            does_exist = true;
+            break;
+          } else {
+            ++id;
+            if(id > larger_n){
+              id %= larger_n;
+            }
+            if(++n_probe == max_probe){
+              return false;
+            }
+          }
+        }
+        
+        if(!does_exist){
+          hashed_obs_vec[id] = i + 1;
+          p_index[i] = ++g;
+          if(is_final){
+            vec_first_obs.push_back(i + 1);
+          }
         }
       }
     }
@@ -361,55 +809,87 @@ void general_type_to_index_single(r_vector *x, int *__restrict p_index, int &n_g
     // => explains why I needed to repeat all the for loops
     const bool any_na = x->any_na;
     const int NA_value = x->NA_value;
-    for(size_t i=0 ; i<n ; ++i){
+    for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+      const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
       
-      if(x_type == T_DBL_INT){
-        if(any_na){
-          if(std::isnan(px_dbl[i])){
-            id = hash_single(NA_value, shifter);
+      for(size_t i=i_start ; i<i_end ; ++i){
+        if(x_type == T_DBL_INT){
+          if(any_na){
+            if(std::isnan(px_dbl[i])){
+              id = hash_single(NA_value, shifter, seed);
+            } else {
+              id = hash_single((int) px_dbl[i], shifter, seed);
+            }
           } else {
-            id = hash_single((int) px_dbl[i], shifter);
+            id = hash_single((int) px_dbl[i], shifter, seed);
           }
         } else {
-          id = hash_single((int) px_dbl[i], shifter);
+          id = hash_single(double_to_uint32(px_dbl[i], seed), shifter, seed);
         }
-      } else {
-        id = hash_single(double_to_uint32(px_dbl[i]), shifter);
-      }      
+        block_id[i - i_start] = id;
+        PREFETCH(hashed_obs_vec + id);
+      }
       
-      bool does_exist = false;
-      while(hashed_obs_vec[id] != 0){
-        obs = hashed_obs_vec[id] - 1;
-        if(is_equal_dbl(px_dbl[obs], px_dbl[i])){
-          p_index[i] = p_index[obs];
-          does_exist = true;
-          break;
-        } else {
-          ++id;
-          if(id > larger_n){
-            id %= larger_n;
-          }
+      for(size_t b=0 ; b<i_end - i_start ; ++b){
+        obs = hashed_obs_vec[block_id[b]];
+        if(obs != 0){
+          PREFETCH(px_dbl + obs - 1);
+          PREFETCH(p_index + obs - 1);
         }
       }
-
-      if(!does_exist){
-        hashed_obs_vec[id] = i + 1;
-        p_index[i] = ++g;
-        if(is_final){
-          vec_first_obs.push_back(i + 1);
+      
+      for(size_t i=i_start ; i<i_end ; ++i){
+        id = block_id[i - i_start];
+        
+        bool does_exist = false;
+        int n_probe = 0;
+        while(hashed_obs_vec[id] != 0){
+          obs = hashed_obs_vec[id] - 1;
+          if(is_equal_dbl(px_dbl[obs], px_dbl[i])){
+            p_index[i] = p_index[obs];
+            does_exist = true;
+            break;
+          } else {
+            ++id;
+            if(id > larger_n){
+              id %= larger_n;
+            }
+            if(++n_probe == max_probe){
+              return false;
+            }
+          }
+        }
+        
+        if(!does_exist){
+          hashed_obs_vec[id] = i + 1;
+          p_index[i] = ++g;
+          if(is_final){
+            vec_first_obs.push_back(i + 1);
+          }
         }
       }
     }
   }
   
   n_groups = g;
-  delete[] hashed_obs_vec;
   
+  return true;
 }
 
-void general_type_to_index_double(r_vector *x, int *__restrict p_index_in, 
+// counts of the new groups created by an engine, within the groups of another index
+// used to count the distinct values of a vector within groups, see cpp_n_distinct_main
+struct group_counter {
+  const int *p_index = nullptr;
+  vector<int> count;
+};
+
+bool general_type_to_index_double(r_vector *x, int *__restrict p_index_in, 
                                   int *__restrict p_index_out, int &n_groups,
-                                  vector<int> &vec_first_obs, bool is_final){
+                                  vector<int> &vec_first_obs, bool is_final, 
+                                  uint32_t seed, int max_probe, 
+                                  group_counter *p_counter = nullptr){
+  // p_counter: if not null, the new groups are counted within the groups of p_counter->p_index
+  //
   // Two differences with the *_single version:
   // - when hashing and checking for collision => we use the extra index
   // - we include the possibility of fast ints
@@ -421,6 +901,7 @@ void general_type_to_index_double(r_vector *x, int *__restrict p_index_in,
   const int *px_int = (int *) x->px_int;
   const double *px_dbl = (double *) x->px_dbl;
   const intptr_t *px_intptr = (intptr_t *) x->px_intptr;
+  const int64_t *px_int64 = (int64_t *) x->px_int64;
   
   const int x_type = x->type;
   int g = 0;
@@ -474,6 +955,9 @@ void general_type_to_index_double(r_vector *x, int *__restrict p_index_in,
         if(is_final){
           vec_first_obs.push_back(i + 1);
         }
+        if(p_counter){
+          ++p_counter->count[p_counter->p_index[i] - 1];
+        }
       } else {
         p_index_out[i] = int_array[id];
       }
@@ -500,61 +984,170 @@ void general_type_to_index_double(r_vector *x, int *__restrict p_index_in,
     int *hashed_obs_vec = new int[larger_n + 1];
     std::fill_n(hashed_obs_vec, larger_n + 1, 0);
     
+    // the IDs of the current block of rows (see PROBE_BLOCK)
+    uint32_t block_id[PROBE_BLOCK];
+    
     uint32_t id = 0;
     int obs = 0;
     if(x_type == T_STR){
-      for(size_t i=0 ; i<n ; ++i){
+      for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+        const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
         
-        id = hash_double(px_intptr[i] & 0xffffffff, p_index_in[i], shifter);
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = hash_double(px_intptr[i] & 0xffffffff, p_index_in[i], shifter, seed);
+          block_id[i - i_start] = id;
+          PREFETCH(hashed_obs_vec + id);
+        }
         
-        bool does_exist = false;
-        while(hashed_obs_vec[id] != 0){
-          obs = hashed_obs_vec[id] - 1;
-          if(px_intptr[obs] == px_intptr[i] && p_index_in[obs] == p_index_in[i]){
-            p_index_out[i] = p_index_out[obs];
-            does_exist = true;
-            break;
-          } else {
-            ++id;
-            if(id > larger_n){
-              id %= larger_n;
-            }
+        for(size_t b=0 ; b<i_end - i_start ; ++b){
+          obs = hashed_obs_vec[block_id[b]];
+          if(obs != 0){
+            PREFETCH(px_intptr + obs - 1);
+            PREFETCH(p_index_in + obs - 1);
+            PREFETCH(p_index_out + obs - 1);
           }
         }
-
-        if(!does_exist){
-          // hash never seen => ok
-          hashed_obs_vec[id] = i + 1;
-          p_index_out[i] = ++g;
-          if(is_final){
-            vec_first_obs.push_back(i + 1);
+        
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = block_id[i - i_start];
+          
+          bool does_exist = false;
+          int n_probe = 0;
+          while(hashed_obs_vec[id] != 0){
+            obs = hashed_obs_vec[id] - 1;
+            if(px_intptr[obs] == px_intptr[i] && p_index_in[obs] == p_index_in[i]){
+              p_index_out[i] = p_index_out[obs];
+              does_exist = true;
+              break;
+            } else {
+              ++id;
+              if(id > larger_n){
+                id %= larger_n;
+              }
+              if(++n_probe == max_probe){
+                delete[] hashed_obs_vec;
+                return false;
+              }
+            }
+          }
+          
+          if(!does_exist){
+            hashed_obs_vec[id] = i + 1;
+            p_index_out[i] = ++g;
+            if(is_final){
+              vec_first_obs.push_back(i + 1);
+            }
+            if(p_counter){
+              ++p_counter->count[p_counter->p_index[i] - 1];
+            }
           }
         }
       }
     } else if(x_type == T_INT){
-      for(size_t i=0 ; i<n ; ++i){
-        id = hash_double(px_int[i], p_index_in[i], shifter);
+      for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+        const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
         
-        bool does_exist = false;
-        while(hashed_obs_vec[id] != 0){
-          obs = hashed_obs_vec[id] - 1;
-          if(px_int[obs] == px_int[i] && p_index_in[obs] == p_index_in[i]){
-            p_index_out[i] = p_index_out[obs];
-            does_exist = true;
-            break;
-          } else {
-            ++id;
-            if(id > larger_n){
-              id %= larger_n;
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = hash_double(px_int[i], p_index_in[i], shifter, seed);
+          block_id[i - i_start] = id;
+          PREFETCH(hashed_obs_vec + id);
+        }
+        
+        for(size_t b=0 ; b<i_end - i_start ; ++b){
+          obs = hashed_obs_vec[block_id[b]];
+          if(obs != 0){
+            PREFETCH(px_int + obs - 1);
+            PREFETCH(p_index_in + obs - 1);
+            PREFETCH(p_index_out + obs - 1);
+          }
+        }
+        
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = block_id[i - i_start];
+          
+          bool does_exist = false;
+          int n_probe = 0;
+          while(hashed_obs_vec[id] != 0){
+            obs = hashed_obs_vec[id] - 1;
+            if(px_int[obs] == px_int[i] && p_index_in[obs] == p_index_in[i]){
+              p_index_out[i] = p_index_out[obs];
+              does_exist = true;
+              break;
+            } else {
+              ++id;
+              if(id > larger_n){
+                id %= larger_n;
+              }
+              if(++n_probe == max_probe){
+                delete[] hashed_obs_vec;
+                return false;
+              }
+            }
+          }
+          
+          if(!does_exist){
+            hashed_obs_vec[id] = i + 1;
+            p_index_out[i] = ++g;
+            if(is_final){
+              vec_first_obs.push_back(i + 1);
+            }
+            if(p_counter){
+              ++p_counter->count[p_counter->p_index[i] - 1];
             }
           }
         }
-
-        if(!does_exist){
-          hashed_obs_vec[id] = i + 1;
-          p_index_out[i] = ++g;
-          if(is_final){
-            vec_first_obs.push_back(i + 1);
+      }
+    } else if(x_type == T_INT64){
+      for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+        const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
+        
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = hash_double(int64_to_uint32(px_int64[i], seed), p_index_in[i], shifter, seed);
+          block_id[i - i_start] = id;
+          PREFETCH(hashed_obs_vec + id);
+        }
+        
+        for(size_t b=0 ; b<i_end - i_start ; ++b){
+          obs = hashed_obs_vec[block_id[b]];
+          if(obs != 0){
+            PREFETCH(px_int64 + obs - 1);
+            PREFETCH(p_index_in + obs - 1);
+            PREFETCH(p_index_out + obs - 1);
+          }
+        }
+        
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = block_id[i - i_start];
+          
+          bool does_exist = false;
+          int n_probe = 0;
+          while(hashed_obs_vec[id] != 0){
+            obs = hashed_obs_vec[id] - 1;
+            if(px_int64[obs] == px_int64[i] && p_index_in[obs] == p_index_in[i]){
+              p_index_out[i] = p_index_out[obs];
+              does_exist = true;
+              break;
+            } else {
+              ++id;
+              if(id > larger_n){
+                id %= larger_n;
+              }
+              if(++n_probe == max_probe){
+                delete[] hashed_obs_vec;
+                return false;
+              }
+            }
+          }
+          
+          if(!does_exist){
+            hashed_obs_vec[id] = i + 1;
+            p_index_out[i] = ++g;
+            if(is_final){
+              vec_first_obs.push_back(i + 1);
+            }
+            if(p_counter){
+              ++p_counter->count[p_counter->p_index[i] - 1];
+            }
           }
         }
       }
@@ -564,42 +1157,68 @@ void general_type_to_index_double(r_vector *x, int *__restrict p_index_in,
       // => explains why I needed to repeat all the for loops
       const bool any_na = x->any_na;
       const int NA_value = x->NA_value;
-      for(size_t i=0 ; i<n ; ++i){
+      for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+        const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
         
-        if(x_type == T_DBL_INT){
-          if(any_na){
-            if(std::isnan(px_dbl[i])){
-              id = hash_double(NA_value, p_index_in[i], shifter);
+        for(size_t i=i_start ; i<i_end ; ++i){
+          if(x_type == T_DBL_INT){
+            if(any_na){
+              if(std::isnan(px_dbl[i])){
+                id = hash_double(NA_value, p_index_in[i], shifter, seed);
+              } else {
+                id = hash_double((int) px_dbl[i], p_index_in[i], shifter, seed);
+              }
             } else {
-              id = hash_double((int) px_dbl[i], p_index_in[i], shifter);
+              id = hash_double((int) px_dbl[i], p_index_in[i], shifter, seed);
             }
           } else {
-            id = hash_double((int) px_dbl[i], p_index_in[i], shifter);
+            id = hash_double(double_to_uint32(px_dbl[i], seed), p_index_in[i], shifter, seed);
           }
-        } else {
-          id = hash_double(double_to_uint32(px_dbl[i]), p_index_in[i], shifter);
+          block_id[i - i_start] = id;
+          PREFETCH(hashed_obs_vec + id);
         }
         
-        bool does_exist = false;
-        while(hashed_obs_vec[id] != 0){
-          obs = hashed_obs_vec[id] - 1;
-          if(is_equal_dbl(px_dbl[obs], px_dbl[i]) && p_index_in[obs] == p_index_in[i]){
-            p_index_out[i] = p_index_out[obs];
-            does_exist = true;
-            break;
-          } else {
-            ++id;
-            if(id > larger_n){
-              id %= larger_n;
-            }
+        for(size_t b=0 ; b<i_end - i_start ; ++b){
+          obs = hashed_obs_vec[block_id[b]];
+          if(obs != 0){
+            PREFETCH(px_dbl + obs - 1);
+            PREFETCH(p_index_in + obs - 1);
+            PREFETCH(p_index_out + obs - 1);
           }
         }
-
-        if(!does_exist){
-          hashed_obs_vec[id] = i + 1;
-          p_index_out[i] = ++g;
-          if(is_final){
-            vec_first_obs.push_back(i + 1);
+        
+        for(size_t i=i_start ; i<i_end ; ++i){
+          id = block_id[i - i_start];
+          
+          bool does_exist = false;
+          int n_probe = 0;
+          while(hashed_obs_vec[id] != 0){
+            obs = hashed_obs_vec[id] - 1;
+            if(is_equal_dbl(px_dbl[obs], px_dbl[i]) && p_index_in[obs] == p_index_in[i]){
+              p_index_out[i] = p_index_out[obs];
+              does_exist = true;
+              break;
+            } else {
+              ++id;
+              if(id > larger_n){
+                id %= larger_n;
+              }
+              if(++n_probe == max_probe){
+                delete[] hashed_obs_vec;
+                return false;
+              }
+            }
+          }
+          
+          if(!does_exist){
+            hashed_obs_vec[id] = i + 1;
+            p_index_out[i] = ++g;
+            if(is_final){
+              vec_first_obs.push_back(i + 1);
+            }
+            if(p_counter){
+              ++p_counter->count[p_counter->p_index[i] - 1];
+            }
           }
         }
       }
@@ -609,7 +1228,60 @@ void general_type_to_index_double(r_vector *x, int *__restrict p_index_in,
   }
   
   n_groups = g;
+  
+  return true;
+}
+
+inline uint32_t next_seed(uint32_t seed, const void *p, int attempt){
+  // new non-null seed, different for each call (p is any fresh address, 
+  // attempt the number of the attempt)
+  uint32_t new_seed = mix_seed(seed + 0x9e3779b9 * (attempt + 1), (uint32_t) (uintptr_t) p);
+  return new_seed == 0 ? 1 : new_seed;
+}
+
+void safe_type_to_index_single(r_vector *x, int *__restrict p_index, int &n_groups,
+                               vector<int> &vec_first_obs, bool is_final, uint32_t seed, 
+                               int_buffer *p_table = nullptr){
+  // general_type_to_index_single with a bound on the probe length
+  // if a probe is too long, we start over with a new seed
+  // as a last resort (very unlikely), there is no bound
+  
+  const size_t n_first_obs = vec_first_obs.size();
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(general_type_to_index_single(x, p_index, n_groups, vec_first_obs, is_final, 
+                                    seed, max_probe, p_table)){
+      return;
+    }
+    
+    vec_first_obs.resize(n_first_obs);
+    seed = next_seed(seed, p_index, attempt);
+  }
+}
+
+void safe_type_to_index_double(r_vector *x, int *__restrict p_index_in, 
+                               int *__restrict p_index_out, int &n_groups,
+                               vector<int> &vec_first_obs, bool is_final, uint32_t seed, 
+                               group_counter *p_counter = nullptr){
+  // see safe_type_to_index_single
+  // NOTA: p_index_in and n_groups are only modified on success
+  
+  const size_t n_first_obs = vec_first_obs.size();
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(general_type_to_index_double(x, p_index_in, p_index_out, n_groups, vec_first_obs, is_final, 
+                                    seed, max_probe, p_counter)){
+      return;
+    }
+    
+    vec_first_obs.resize(n_first_obs);
+    if(p_counter){
+      std::fill(p_counter->count.begin(), p_counter->count.end(), 0);
+    }
+    seed = next_seed(seed, p_index_out, attempt);
+  }
 }
+
 inline void update_index_intarray_g_obs(int id, size_t i, int &g, int * &int_array, 
                                         int *__restrict &p_index, bool &is_final, vector<int> &vec_first_obs){
   
@@ -625,9 +1297,214 @@ inline void update_index_intarray_g_obs(int id, size_t i, int &g, int * &int_arr
   }  
 }
 
+void sorted_vector_to_index(SEXP x, int *__restrict p_index, int &n_groups,
+                            vector<int> &vec_first_obs){
+  // x is known to be sorted => equal values are contiguous
+  // we only need to compare each value to the previous one: no table at all
+  // 
+  // the values are read by chunks with *_GET_REGION: ALTREP compact sequences
+  // compute their elements on the fly and are never expanded in memory
+  
+  const size_t n = Rf_length(x);
+  const size_t chunk_size = 4096;
+  
+  int g = 0;
+  if(TYPEOF(x) == INTSXP){
+    int chunk[chunk_size];
+    int previous = 0;
+    for(size_t i_start=0 ; i_start<n ; i_start += chunk_size){
+      size_t n_chunk = INTEGER_GET_REGION(x, i_start, chunk_size, chunk);
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        if(g == 0 || chunk[j] != previous){
+          ++g;
+          vec_first_obs.push_back(i_start + j + 1);
+          previous = chunk[j];
+        }
+        p_index[i_start + j] = g;
+      }
+    }
+  } else {
+    double chunk[chunk_size];
+    double previous = 0;
+    for(size_t i_start=0 ; i_start<n ; i_start += chunk_size){
+      size_t n_chunk = REAL_GET_REGION(x, i_start, chunk_size, chunk);
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        if(g == 0 || !is_equal_dbl(chunk[j], previous)){
+          ++g;
+          vec_first_obs.push_back(i_start + j + 1);
+          previous = chunk[j];
+        }
+        p_index[i_start + j] = g;
+      }
+    }
+  }
+  
+  n_groups = g;
+}
+
+bool is_clustered_sample(const vector<std::shared_ptr<r_vector>> &all_vecs, size_t n){
+  // quick check to find out whether the data looks clustered,
+  // i.e. if the rows with identical values tend to be contiguous
+  // we look at blocks of consecutive rows spread over the whole data 
+  // (a sorted head may be followed by an unordered tail)
+  // we require runs of 4 rows on average
+  
+  const size_t n_blocks = 16;
+  const size_t block_size = 64;
+  if(n < 8){
+    return false;
+  }
+  
+  size_t n_pairs = 0, n_breaks = 0;
+  if(n <= n_blocks * block_size){
+    for(size_t i=1 ; i<n ; ++i){
+      n_breaks += !is_same_row(all_vecs, i, i - 1);
+    }
+    n_pairs = n - 1;
+  } else {
+    const size_t step = (n - block_size) / (n_blocks - 1);
+    for(size_t b=0 ; b<n_blocks ; ++b){
+      const size_t i_start = b * step;
+      for(size_t i=i_start + 1 ; i<i_start + block_size ; ++i){
+        n_breaks += !is_same_row(all_vecs, i, i - 1);
+      }
+    }
+    n_pairs = n_blocks * (block_size - 1);
+  }
+  
+  return 4 * (n_breaks + 1) <= n_pairs + 1;
+}
+
+template<typename T>
+void mark_new_runs(const T *__restrict px, size_t n, unsigned char *__restrict is_new){
+  // is_new[i] is set to 1 if px[i] differs from px[i - 1]
+  // simple loop on contiguous data: it is vectorized by the compiler
+  for(size_t i=1 ; i<n ; ++i){
+    is_new[i] |= px[i] != px[i - 1];
+  }
+}
+
+void mark_new_runs_dbl(const double *__restrict px, size_t n, unsigned char *__restrict is_new){
+  // all NAs/NaNs are equal
+  for(size_t i=1 ; i<n ; ++i){
+    const double a = px[i], b = px[i - 1];
+    is_new[i] |= (a != b) & !(a != a && b != b);
+  }
+}
+
+bool clustered_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, int *__restrict p_index, 
+                        int &n_groups, vector<int> &vec_first_obs, uint32_t seed, int max_probe){
+  // the rows are clustered: all rows of a group tend to be contiguous
+  // - the run boundaries are found column by column, each column being compared 
+  //   to itself shifted by one row (typed loops on contiguous data)
+  // - only the first row of each run is hashed
+  // => the hash table holds one entry per run instead of one per row
+  // seed, max_probe: see general_type_to_index_single
+  // returns false if a probe was too long, in which case the index is invalid
+  
+  const size_t n = all_vecs[0]->n;
+  if(n == 0){
+    n_groups = 0;
+    return true;
+  }
+  
+  // first pass: the run boundaries
+  vector<unsigned char> is_new(n, 0);
+  is_new[0] = 1;
+  for(auto &&x : all_vecs){
+    if(x->type == T_INT){
+      mark_new_runs(x->px_int, n, is_new.data());
+    } else if(x->type == T_INT64){
+      mark_new_runs(x->px_int64, n, is_new.data());
+    } else if(x->type == T_STR){
+      mark_new_runs(x->px_intptr, n, is_new.data());
+    } else {
+      mark_new_runs_dbl(x->px_dbl, n, is_new.data());
+    }
+  }
+  
+  vector<int> run_start;
+  for(size_t i=0 ; i<n ; ++i){
+    if(is_new[i]){
+      run_start.push_back(i);
+    }
+  }
+  vector<unsigned char>().swap(is_new);
+  
+  const size_t n_runs = run_start.size();
+  run_start.push_back(n);
+  
+  int shifter = power_of_two(2.0 * n_runs + 1.0);
+  if(shifter < 8) shifter = 8;
+  size_t larger_n = std::pow(2, shifter);
+  
+  int *hashed_obs_vec = new int[larger_n + 1];
+  std::fill_n(hashed_obs_vec, larger_n + 1, 0);
+  
+  int g = 0;
+  uint32_t id = 0;
+  int obs = 0;
+  for(size_t r=0 ; r<n_runs ; ++r){
+    
+    // new run: we hash the full row
+    const int i = run_start[r];
+    id = hash_row(all_vecs, i, seed) >> (32 - shifter);
+    
+    int g_run = 0;
+    int n_probe = 0;
+    while(hashed_obs_vec[id] != 0){
+      obs = hashed_obs_vec[id] - 1;
+      if(is_same_row(all_vecs, obs, i)){
+        g_run = p_index[obs];
+        break;
+      } else {
+        ++id;
+        if(id > larger_n){
+          id %= larger_n;
+        }
+        if(++n_probe == max_probe){
+          delete[] hashed_obs_vec;
+          return false;
+        }
+      }
+    }
+    
+    if(g_run == 0){
+      hashed_obs_vec[id] = i + 1;
+      g_run = ++g;
+      vec_first_obs.push_back(i + 1);
+    }
+    
+    std::fill(p_index + i, p_index + run_start[r + 1], g_run);
+  }
+  
+  n_groups = g;
+  delete[] hashed_obs_vec;
+  
+  return true;
+}
+
+void safe_clustered_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, int *__restrict p_index, 
+                             int &n_groups, vector<int> &vec_first_obs, uint32_t seed){
+  // see safe_type_to_index_single
+  
+  const size_t n_first_obs = vec_first_obs.size();
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(clustered_to_index(all_vecs, p_index, n_groups, vec_first_obs, seed, max_probe)){
+      return;
+    }
+    
+    vec_first_obs.resize(n_first_obs);
+    seed = next_seed(seed, p_index, attempt);
+  }
+}
+
 void multiple_ints_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, vector<int> &all_k, 
                             int *__restrict p_index, int &n_groups,
-                            vector<int> &vec_first_obs, bool is_final){
+                            vector<int> &vec_first_obs, bool is_final, 
+                            int_buffer *p_table = nullptr){
+  // p_table: buffer for the lookup table, if null a new table is allocated
   
   int sum_bin_ranges = 0;
   int K = all_k.size();
@@ -647,8 +1524,8 @@ void multiple_ints_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, v
   const int x0_min = x0->x_min;
   
   size_t lookup_size = K == 1 ? x0->x_range + 1 : std::pow(2, sum_bin_ranges + K - 1);
-  int *int_array = new int[lookup_size];
-  std::fill_n(int_array, lookup_size, 0);
+  int_buffer local_table;
+  int *int_array = (p_table ? p_table : &local_table)->get_zeroed(lookup_size);
   
   int g = 0;                    
   
@@ -831,82 +1708,567 @@ void multiple_ints_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, v
   }
   
   n_groups = g;
-  
-  delete[] int_array;
 }
 
+//
+// low memory
+//
 
-SEXP cpp_to_index_main(SEXP &x){
-  // x: vector or list of vectors of the same length (n)
-  // returns:
-  // - index: vector of length n, from 1 to the numberof unique values of x (g)
-  // - first_obs: vector of length g of the first observation belonging to each group
+// In low memory mode, the index is created in a single pass over the full rows,
+// writing directly into the output:
+// - there is no intermediary index (p_extra_index) nor sum_vec
+// - the hash table refers to the groups, not to the observations: it is sized 
+//   from a bound on the number of groups and doubled when half full
+// All the allocations are tracked to report the peak memory.
+
+class mem_tracker {
+public:
+  double current = 0;
+  double peak = 0;
   
-  size_t n = 0;
-  int K = 0;
+  void add(double bytes){
+    current += bytes;
+    if(current > peak){
+      peak = current;
+    }
+  }
   
-  // NOTA: because the UNPROTECT is tied to the destructor, we do not want any
-  //       copy => we use smart pointers
-  std::vector<std::shared_ptr<r_vector>> all_pvecs;
+  void remove(double bytes){
+    current -= bytes;
+  }
+};
+
+double cardinality_bound(const vector<std::shared_ptr<r_vector>> &all_vecs, size_t n){
+  // upper bound on the number of groups: the product of the ranges of the 
+  // integer vectors, n if there is any other type
   
-  // we set up the info with the rvec class. It makes it easy to pass across functions
-  bool is_error = false;
-  std::string error_msg;
-  if(TYPEOF(x) == VECSXP){
-    K = Rf_length(x);
-    for(int k=0; k<K; ++k){
-      
-      std::shared_ptr<r_vector> prvec = std::make_shared<r_vector>(VECTOR_ELT(x, k));
-      all_pvecs.push_back(prvec);
-      
-      if(all_pvecs.back()->is_error){
-        is_error = true;
-        error_msg = all_pvecs.back()->error_msg;
-        break;
-      }
-      
-      if(k == 0){
-        n = Rf_length(VECTOR_ELT(x, 0));
-      } else if((size_t) Rf_length(VECTOR_ELT(x, k)) != n){
-        is_error = true;
-        error_msg = "All the vectors to turn into an index must be of the same length. This is currently not the case.";
-        break;
-      }
+  double bound = 1;
+  for(auto &&x : all_vecs){
+    if(x->type == T_STR || x->type == T_DBL || x->type == T_INT64){
+      return n;
     }
     
-  } else {
-    K = 1;
-    n = Rf_length(x);
-    std::shared_ptr<r_vector> prvec = std::make_shared<r_vector>(x);
-    all_pvecs.push_back(prvec);
+    // the range is an int: it overflows (and may become negative) for wide ranges
+    if(x->x_range <= 0){
+      return n;
+    }
+    
+    bound *= x->x_range;
+    if(bound >= n || bound <= 0){
+      return n;
+    }
   }
   
-  if(is_error){
-    SEXP sexp_is_error = PROTECT(Rf_allocVector(LGLSXP, 1));
-    SEXP sexp_error_msg = PROTECT(std_string_to_r_string({error_msg}));
-    SEXP res = PROTECT(Rf_allocVector(VECSXP, 2));
-    SET_VECTOR_ELT(res, 0, sexp_is_error);
-    SET_VECTOR_ELT(res, 1, sexp_error_msg);
-    
-    // names
-    Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"is_error", "error_msg"}));
-    UNPROTECT(3);
-    return res;
-  }
+  return bound;
+}
+
+bool low_memory_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, int *__restrict p_index, 
+                         int &n_groups, vector<int> &vec_first_obs, mem_tracker &mem, 
+                         uint32_t seed, int max_probe){
+  // seed, max_probe: see general_type_to_index_single
+  // returns false if a probe was too long, in which case the index is invalid
   
-  // the result to be returned
-  SEXP index = PROTECT(Rf_allocVector(INTSXP, n));
-  int *p_index = INTEGER(index);
+  const size_t n = all_vecs[0]->n;
   
-  // vector of the first observation of the group
-  std::vector<int> vec_first_obs;
+  // when the bound is not informative, we start small and grow
+  const double bound = cardinality_bound(all_vecs, n);
+  const double n_groups_init = bound < n ? bound : std::min((double) n, 1024.0);
   
-  // finding out the fast cases
-  // Note that partial fast ordering is enabled and 
-  // we stop at the first feasible possibility
+  int shifter = power_of_two(2.0 * n_groups_init + 1.0);
+  if(shifter < 8) shifter = 8;
+  size_t larger_n = std::pow(2, shifter);
+  
+  // hashed_g_vec[ID]: the group of the first row with hash ID (0 = empty)
+  // the row is retrieved with vec_first_obs
+  int *hashed_g_vec = new int[larger_n + 1];
+  std::fill_n(hashed_g_vec, larger_n + 1, 0);
+  mem.add(sizeof(int) * (larger_n + 1));
+  
+  vec_first_obs.reserve(n_groups_init);
+  size_t first_obs_capacity = vec_first_obs.capacity();
+  mem.add(sizeof(int) * first_obs_capacity);
+  
+  int g = 0;
+  uint32_t id = 0;
+  int obs = 0;
+  for(size_t i=0 ; i<n ; ++i){
+    
+    id = hash_row(all_vecs, i, seed) >> (32 - shifter);
+    
+    bool does_exist = false;
+    int n_probe = 0;
+    while(hashed_g_vec[id] != 0){
+      obs = vec_first_obs[hashed_g_vec[id] - 1] - 1;
+      if(is_same_row(all_vecs, obs, i)){
+        p_index[i] = hashed_g_vec[id];
+        does_exist = true;
+        break;
+      } else {
+        ++id;
+        if(id > larger_n){
+          id %= larger_n;
+        }
+        if(++n_probe == max_probe){
+          delete[] hashed_g_vec;
+          mem.remove(sizeof(int) * (larger_n + 1));
+          mem.remove(sizeof(int) * first_obs_capacity);
+          return false;
+        }
+      }
+    }
+    
+    if(does_exist){
+      continue;
+    }
+    
+    hashed_g_vec[id] = ++g;
+    p_index[i] = g;
+    vec_first_obs.push_back(i + 1);
+    
+    if(vec_first_obs.capacity() != first_obs_capacity){
+      // both buffers coexist during the reallocation
+      mem.add(sizeof(int) * vec_first_obs.capacity());
+      mem.remove(sizeof(int) * first_obs_capacity);
+      first_obs_capacity = vec_first_obs.capacity();
+    }
+    
+    if(2 * (size_t) g > larger_n){
+      // the table is half full: we double its size and re-insert the groups
+      ++shifter;
+      size_t new_larger_n = std::pow(2, shifter);
+      int *new_hashed_g_vec = new int[new_larger_n + 1];
+      std::fill_n(new_hashed_g_vec, new_larger_n + 1, 0);
+      mem.add(sizeof(int) * (new_larger_n + 1));
+      
+      for(int h=1 ; h<=g ; ++h){
+        id = hash_row(all_vecs, vec_first_obs[h - 1] - 1, seed) >> (32 - shifter);
+        int n_probe = 0;
+        while(new_hashed_g_vec[id] != 0){
+          ++id;
+          if(id > new_larger_n){
+            id %= new_larger_n;
+          }
+          if(++n_probe == max_probe){
+            delete[] new_hashed_g_vec;
+            delete[] hashed_g_vec;
+            mem.remove(sizeof(int) * (new_larger_n + 1));
+            mem.remove(sizeof(int) * (larger_n + 1));
+            mem.remove(sizeof(int) * first_obs_capacity);
+            return false;
+          }
+        }
+        new_hashed_g_vec[id] = h;
+      }
+      
+      delete[] hashed_g_vec;
+      mem.remove(sizeof(int) * (larger_n + 1));
+      
+      hashed_g_vec = new_hashed_g_vec;
+      larger_n = new_larger_n;
+    }
+  }
+  
+  n_groups = g;
+  delete[] hashed_g_vec;
+  mem.remove(sizeof(int) * (larger_n + 1));
+  
+  return true;
+}
+
+void safe_low_memory_to_index(const vector<std::shared_ptr<r_vector>> &all_vecs, int *__restrict p_index, 
+                              int &n_groups, vector<int> &vec_first_obs, mem_tracker &mem, 
+                              uint32_t seed){
+  // see safe_type_to_index_single
+  // NOTA: on failure, the buffer of vec_first_obs is kept (and accounted for again)
+  
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(low_memory_to_index(all_vecs, p_index, n_groups, vec_first_obs, mem, seed, max_probe)){
+      return;
+    }
+    
+    vec_first_obs.clear();
+    seed = next_seed(seed, p_index, attempt);
+  }
+}
+
+
+//
+// lazy subsets
+//
+
+// ALTREP vectors equal to x[pos], x and pos being left untouched:
+// - data1: list(x, pos), pos being 1-based and possibly NA
+// - data2: the materialized vector, R_NilValue until the data pointer is requested
+// 
+// Elements are fetched from x only when accessed. This is used to return the 
+// items (x[first_obs]) and the sorted index (rank[index]) without allocation.
+
+R_altrep_class_t lazy_subset_int_class;
+R_altrep_class_t lazy_subset_lgl_class;
+R_altrep_class_t lazy_subset_dbl_class;
+R_altrep_class_t lazy_subset_str_class;
+bool is_lazy_subset_init = false;
+
+// the package registering the classes: replaced by the target package when vendored
+const char *LAZY_SUBSET_PKG = "indexthis";
+
+inline SEXP lazy_subset_source(SEXP x){
+  return VECTOR_ELT(R_altrep_data1(x), 0);
+}
+
+inline SEXP lazy_subset_pos(SEXP x){
+  return VECTOR_ELT(R_altrep_data1(x), 1);
+}
+
+R_xlen_t lazy_subset_length(SEXP x){
+  return Rf_xlength(lazy_subset_pos(x));
+}
+
+SEXP lazy_subset_expand(SEXP x){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    return expanded;
+  }
+  
+  SEXP source = lazy_subset_source(x);
+  SEXP pos = lazy_subset_pos(x);
+  const R_xlen_t n = Rf_xlength(pos);
+  const int *p_pos = INTEGER(pos);
+  
+  // the source is read element-wise: if it is itself ALTREP (e.g. 1:n), 
+  // it must not be expanded just to read the n elements of the subset
+  expanded = PROTECT(Rf_allocVector(TYPEOF(source), n));
+  if(TYPEOF(source) == REALSXP){
+    double *py = REAL(expanded);
+    for(R_xlen_t i=0 ; i<n ; ++i){
+      py[i] = p_pos[i] == NA_INTEGER ? NA_REAL : REAL_ELT(source, p_pos[i] - 1);
+    }
+  } else if(TYPEOF(source) == STRSXP){
+    for(R_xlen_t i=0 ; i<n ; ++i){
+      SET_STRING_ELT(expanded, i, p_pos[i] == NA_INTEGER ? NA_STRING : STRING_ELT(source, p_pos[i] - 1));
+    }
+  } else if(TYPEOF(source) == INTSXP){
+    int *py = INTEGER(expanded);
+    for(R_xlen_t i=0 ; i<n ; ++i){
+      py[i] = p_pos[i] == NA_INTEGER ? NA_INTEGER : INTEGER_ELT(source, p_pos[i] - 1);
+    }
+  } else {
+    int *py = LOGICAL(expanded);
+    for(R_xlen_t i=0 ; i<n ; ++i){
+      py[i] = p_pos[i] == NA_INTEGER ? NA_LOGICAL : LOGICAL_ELT(source, p_pos[i] - 1);
+    }
+  }
+  
+  R_set_altrep_data2(x, expanded);
+  UNPROTECT(1);
+  
+  return expanded;
+}
+
+void *lazy_subset_dataptr(SEXP x, Rboolean /* writeable */){
+  SEXP expanded = lazy_subset_expand(x);
+  switch(TYPEOF(expanded)){
+    case INTSXP: return INTEGER(expanded);
+    case LGLSXP: return LOGICAL(expanded);
+    case REALSXP: return REAL(expanded);
+    default: return (void *) STRING_PTR_RO(expanded);
+  }
+}
+
+const void *lazy_subset_dataptr_or_null(SEXP x){
+  if(R_altrep_data2(x) == R_NilValue){
+    return nullptr;
+  }
+  
+  return lazy_subset_dataptr(x, FALSE);
+}
+
+int lazy_subset_int_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    return INTEGER(expanded)[i];
+  }
+  
+  int pos = INTEGER(lazy_subset_pos(x))[i];
+  return pos == NA_INTEGER ? NA_INTEGER : INTEGER_ELT(lazy_subset_source(x), pos - 1);
+}
+
+int lazy_subset_lgl_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    return LOGICAL(expanded)[i];
+  }
+  
+  int pos = INTEGER(lazy_subset_pos(x))[i];
+  return pos == NA_INTEGER ? NA_LOGICAL : LOGICAL_ELT(lazy_subset_source(x), pos - 1);
+}
+
+double lazy_subset_dbl_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    return REAL(expanded)[i];
+  }
+  
+  int pos = INTEGER(lazy_subset_pos(x))[i];
+  return pos == NA_INTEGER ? NA_REAL : REAL_ELT(lazy_subset_source(x), pos - 1);
+}
+
+SEXP lazy_subset_str_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    return STRING_ELT(expanded, i);
+  }
+  
+  int pos = INTEGER(lazy_subset_pos(x))[i];
+  return pos == NA_INTEGER ? NA_STRING : STRING_ELT(lazy_subset_source(x), pos - 1);
+}
+
+void lazy_subset_str_set_elt(SEXP x, R_xlen_t i, SEXP value){
+  SET_STRING_ELT(lazy_subset_expand(x), i, value);
+}
+
+void init_lazy_subset_classes(DllInfo *dll){
+  
+  lazy_subset_int_class = R_make_altinteger_class("lazy_subset_int", LAZY_SUBSET_PKG, dll);
+  lazy_subset_lgl_class = R_make_altlogical_class("lazy_subset_lgl", LAZY_SUBSET_PKG, dll);
+  lazy_subset_dbl_class = R_make_altreal_class("lazy_subset_dbl", LAZY_SUBSET_PKG, dll);
+  lazy_subset_str_class = R_make_altstring_class("lazy_subset_str", LAZY_SUBSET_PKG, dll);
+  
+  for(auto &&cls : {lazy_subset_int_class, lazy_subset_lgl_class, 
+                    lazy_subset_dbl_class, lazy_subset_str_class}){
+    R_set_altrep_Length_method(cls, lazy_subset_length);
+    R_set_altvec_Dataptr_method(cls, lazy_subset_dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, lazy_subset_dataptr_or_null);
+  }
+  
+  R_set_altinteger_Elt_method(lazy_subset_int_class, lazy_subset_int_elt);
+  R_set_altlogical_Elt_method(lazy_subset_lgl_class, lazy_subset_lgl_elt);
+  R_set_altreal_Elt_method(lazy_subset_dbl_class, lazy_subset_dbl_elt);
+  R_set_altstring_Elt_method(lazy_subset_str_class, lazy_subset_str_elt);
+  R_set_altstring_Set_elt_method(lazy_subset_str_class, lazy_subset_str_set_elt);
+  
+  is_lazy_subset_init = true;
+}
+
+SEXP cpp_lazy_subset_main(SEXP x, SEXP pos){
+  // x: integer, logical, double or character vector
+  // pos: integer vector of 1-based positions
+  // returns: x[pos] as an ALTREP vector, R_NilValue if x is not of a valid type
+  //          the attributes of x are not copied
+  
+  if(!is_lazy_subset_init){
+    // when vendored, the routines may not be registered with R_init_pkg
+    init_lazy_subset_classes(R_getEmbeddingDllInfo());
+  }
+  
+  R_altrep_class_t cls;
+  switch(TYPEOF(x)){
+    case INTSXP: cls = lazy_subset_int_class; break;
+    case LGLSXP: cls = lazy_subset_lgl_class; break;
+    case REALSXP: cls = lazy_subset_dbl_class; break;
+    case STRSXP: cls = lazy_subset_str_class; break;
+    default: return R_NilValue;
+  }
+  
+  SEXP data1 = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(data1, 0, x);
+  SET_VECTOR_ELT(data1, 1, pos);
+  
+  SEXP res = R_new_altrep(cls, data1, R_NilValue);
+  UNPROTECT(1);
+  
+  return res;
+}
+
+bool list_to_r_vectors(SEXP x, std::vector<std::shared_ptr<r_vector>> &all_pvecs, 
+                       std::string &error_msg, const vector<int> *p_rows = nullptr, 
+                       const double *p_bin_width = nullptr, const int *p_bin_digits = nullptr){
+  // x: list of vectors of the same length
+  // p_rows: see r_vector
+  // p_bin_width, p_bin_digits: null, or the binning of each vector (see r_vector)
+  // fills all_pvecs, returns true if there was an error
+  
+  const int K = Rf_length(x);
+  size_t n = 0;
+  for(int k=0; k<K; ++k){
+    
+    // the length is checked first: the selected rows are read by r_vector
+    if(k == 0){
+      n = Rf_length(VECTOR_ELT(x, 0));
+    } else if((size_t) Rf_length(VECTOR_ELT(x, k)) != n){
+      error_msg = "All the vectors to turn into an index must be of the same length. This is currently not the case.";
+      return true;
+    }
+    
+    std::shared_ptr<r_vector> prvec = std::make_shared<r_vector>(VECTOR_ELT(x, k), p_rows, 
+                                        p_bin_width ? p_bin_width[k] : 0, 
+                                        p_bin_digits ? p_bin_digits[k] : NA_INTEGER);
+    all_pvecs.push_back(prvec);
+    
+    if(all_pvecs.back()->is_error){
+      error_msg = all_pvecs.back()->error_msg;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+SEXP cpp_to_index_main(SEXP &x, int clustered = NA_LOGICAL, bool low_memory = false, 
+                       uint32_t seed = 0, SEXP subset = R_NilValue, 
+                       SEXP bin_width = R_NilValue, SEXP bin_digits = R_NilValue){
+  // x: vector or list of vectors of the same length (n)
+  // clustered: whether the rows are clustered (see clustered_to_index), 
+  //            if NA: automatic detection
+  // low_memory: whether to use low_memory_to_index (unless x is sorted)
+  // seed: seed of the hash function, 0 for the default hash (see hash_single)
+  // subset: NULL, or the rows to index: either a logical vector of length n 
+  //         (TRUE: selected, FALSE or NA: excluded) or an integer vector of 1-based rows. 
+  //         The rows are not copied as R vectors: the engines work on the data 
+  //         gathered by r_vector.
+  // bin_width, bin_digits: NULL, or vectors of length the number of vectors giving
+  //                        the binning of each double vector (see r_vector), 
+  //                        NA for no binning
+  // returns:
+  // - index: vector of length n (or the number of rows in subset), from 1 to 
+  //          the numberof unique values of x (g)
+  // - first_obs: vector of length g of the first observation belonging to each group
+  //              (the rows refer to x, not to the subset)
+  // - peak_bytes: only if low_memory, the peak memory used by the algorithm
+  
+  size_t n = 0;
+  int K = 0;
+  
+  // the selected rows, 0-based
+  // the subset is checked here and not only in R: invalid rows would be read out of bounds
+  const int n_x = TYPEOF(x) == VECSXP ? (Rf_length(x) == 0 ? 0 : Rf_length(VECTOR_ELT(x, 0))) : 
+                                        Rf_length(x);
+  vector<int> rows;
+  const vector<int> *p_rows = nullptr;
+  if(!Rf_isNull(subset) && TYPEOF(subset) != LGLSXP && TYPEOF(subset) != INTSXP){
+    return error_to_r_list("In `to_index`, the subset must be a logical vector or an integer vector of row numbers.");
+  }
+  
+  if(TYPEOF(subset) == LGLSXP){
+    const int *p_subset = LOGICAL(subset);
+    const int n_subset = Rf_length(subset);
+    if(n_subset != n_x){
+      return error_to_r_list("In `to_index`, the logical subset must be of the same length as the vectors to index.");
+    }
+    for(int i=0 ; i<n_subset ; ++i){
+      if(p_subset[i] == 1){
+        rows.push_back(i);
+      }
+    }
+    p_rows = &rows;
+  } else if(TYPEOF(subset) == INTSXP){
+    const int *p_subset = INTEGER(subset);
+    const int n_subset = Rf_length(subset);
+    rows.resize(n_subset);
+    for(int i=0 ; i<n_subset ; ++i){
+      if(p_subset[i] < 1 || p_subset[i] > n_x){
+        // NA_INTEGER is negative
+        return error_to_r_list("In `to_index`, the row numbers of the subset must be between 1 and " + 
+                               std::to_string(n_x) + ".");
+      }
+      rows[i] = p_subset[i] - 1;
+    }
+    p_rows = &rows;
+  }
+  
+  // NOTA: because the UNPROTECT is tied to the destructor, we do not want any
+  //       copy => we use smart pointers
+  std::vector<std::shared_ptr<r_vector>> all_pvecs;
+  
+  // a single vector already known to be sorted needs neither the range scan 
+  // of r_vector nor any table, see sorted_vector_to_index
+  SEXP x_single = x;
+  if(TYPEOF(x) == VECSXP){
+    x_single = Rf_length(x) == 1 ? VECTOR_ELT(x, 0) : R_NilValue;
+  }
+  
+  // the binning is checked here and not only in R: a vector of the wrong type 
+  // or length would be read out of bounds
+  const int n_vecs = TYPEOF(x) == VECSXP ? Rf_length(x) : 1;
+  if(!Rf_isNull(bin_width) && (TYPEOF(bin_width) != REALSXP || Rf_length(bin_width) != n_vecs)){
+    return error_to_r_list("In `to_index`, the binning widths must be a double vector with one value per vector to index.");
+  }
+  if(!Rf_isNull(bin_digits) && (TYPEOF(bin_digits) != INTSXP || Rf_length(bin_digits) != n_vecs)){
+    return error_to_r_list("In `to_index`, the binning digits must be an integer vector with one value per vector to index.");
+  }
+  const double *p_bin_width = Rf_isNull(bin_width) ? nullptr : REAL(bin_width);
+  const int *p_bin_digits = Rf_isNull(bin_digits) ? nullptr : INTEGER(bin_digits);
+  
+  // a selection of rows of a sorted vector is not known to be sorted
+  // the binning must be done by r_vector
+  const bool is_sorted = !p_rows && !p_bin_width && !p_bin_digits && is_known_sorted(x_single);
+  
+  // we set up the info with the rvec class. It makes it easy to pass across functions
+  bool is_error = false;
+  std::string error_msg;
+  if(is_sorted){
+    K = 1;
+    n = Rf_length(x_single);
+    
+  } else if(TYPEOF(x) == VECSXP){
+    K = Rf_length(x);
+    n = K == 0 ? 0 : Rf_length(VECTOR_ELT(x, 0));
+    is_error = list_to_r_vectors(x, all_pvecs, error_msg, p_rows, p_bin_width, p_bin_digits);
+    
+  } else {
+    K = 1;
+    n = Rf_length(x);
+    std::shared_ptr<r_vector> prvec = std::make_shared<r_vector>(x, p_rows, 
+                                        p_bin_width ? p_bin_width[0] : 0, 
+                                        p_bin_digits ? p_bin_digits[0] : NA_INTEGER);
+    all_pvecs.push_back(prvec);
+  }
+  
+  if(p_rows){
+    n = rows.size();
+  }
+  
+  if(is_error){
+    return error_to_r_list(error_msg);
+  }
+  
+  // the result to be returned
+  SEXP index = PROTECT(Rf_allocVector(INTSXP, n));
+  int *p_index = INTEGER(index);
+  
+  // vector of the first observation of the group
+  std::vector<int> vec_first_obs;
+  
+  int n_groups;
+  
+  // the memory is only tracked in low memory mode
+  // vectors converted to character are included
+  mem_tracker mem;
+  mem.add(sizeof(int) * n);
+  mem.add(sizeof(int) * rows.capacity());
+  for(auto &&x : all_pvecs){
+    if(x->is_protect){
+      mem.add(sizeof(SEXP) * x->n_conv);
+    }
+    mem.add(x->own_data.capacity());
+    mem.add(sizeof(int) * x->int64_offsets.capacity());
+  }
+  
+  //
+  // STEP 0: sorted vector
+  //
+  
+  if(is_sorted){
+    sorted_vector_to_index(x_single, p_index, n_groups, vec_first_obs);
+  }
+  
+  // finding out the fast cases
+  // Note that partial fast ordering is enabled and 
+  // we stop at the first feasible possibility
   int sum_bin_ranges = 0;
   vector<int> id_fast_int;
-  for(int k=0 ; k<K ; ++k){
+  for(int k=0 ; k<K && !is_sorted ; ++k){
     const r_vector &x = *(all_pvecs[k]);
     if(x.is_fast_int){
       int new_bin_range = sum_bin_ranges + x.x_range_bin;
@@ -919,15 +2281,39 @@ SEXP cpp_to_index_main(SEXP &x){
     }
   }
   
-  int n_groups;
+  //
+  // STEP 0 bis: low memory
+  //
+  
+  if(low_memory && !is_sorted){
+    safe_low_memory_to_index(all_pvecs, p_index, n_groups, vec_first_obs, mem, seed);
+  }
+  
+  //
+  // STEP 0 ter: clustered rows
+  //
+  
+  // automatic detection only when hashing is required
+  bool is_clustered = false;
+  if(!is_sorted && !low_memory){
+    if(clustered == NA_LOGICAL){
+      is_clustered = id_fast_int.size() < (size_t) K && is_clustered_sample(all_pvecs, n);
+    } else {
+      is_clustered = clustered;
+    }
+  }
+  
+  if(is_clustered){
+    safe_clustered_to_index(all_pvecs, p_index, n_groups, vec_first_obs, seed);
+  }
   
   //
   // STEP 1: taking care of fast indexing of ints
   //
   
-  bool is_final = false;
+  bool is_final = is_sorted || is_clustered || low_memory;
   bool init_done = false;
-  if(!id_fast_int.empty()){
+  if(!is_final && !id_fast_int.empty()){
     init_done = true;
     
     is_final = (size_t) K == id_fast_int.size();
@@ -958,7 +2344,7 @@ SEXP cpp_to_index_main(SEXP &x){
       all_k_left.erase(all_k_left.begin());
       
       is_final = all_k_left.empty();
-      general_type_to_index_single(all_pvecs[k0].get(), p_index, n_groups, vec_first_obs, is_final);
+      safe_type_to_index_single(all_pvecs[k0].get(), p_index, n_groups, vec_first_obs, is_final, seed);
     }
     
     if(!is_final){
@@ -972,10 +2358,10 @@ SEXP cpp_to_index_main(SEXP &x){
         int k = all_k_left[ind];
         is_final = ind == all_k_left.size() - 1;
         if(is_res_updated_index){
-          general_type_to_index_double(all_pvecs[k].get(), p_index, p_extra_index, n_groups, vec_first_obs, is_final);
+          safe_type_to_index_double(all_pvecs[k].get(), p_index, p_extra_index, n_groups, vec_first_obs, is_final, seed);
           is_res_updated_index = false;
         } else {
-          general_type_to_index_double(all_pvecs[k].get(), p_extra_index, p_index, n_groups, vec_first_obs, is_final);
+          safe_type_to_index_double(all_pvecs[k].get(), p_extra_index, p_index, n_groups, vec_first_obs, is_final, seed);
           is_res_updated_index = true;
         }
       }
@@ -993,34 +2379,1287 @@ SEXP cpp_to_index_main(SEXP &x){
   int *p_first_obs = INTEGER(r_first_obs);
   std::memcpy(p_first_obs, vec_first_obs.data(), sizeof(int) * g);
   
+  if(p_rows){
+    // the first observations refer to the rows of x
+    for(int i=0 ; i<g ; ++i){
+      p_first_obs[i] = rows[p_first_obs[i] - 1] + 1;
+    }
+  }
+  
+  if(is_sorted){
+    mem.add(sizeof(int) * vec_first_obs.capacity());
+  }
+  mem.add(sizeof(int) * g);
+  
   // we save the results into a list
-  SEXP res = PROTECT(Rf_allocVector(VECSXP, 2));
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 2 + low_memory));
   SET_VECTOR_ELT(res, 0, index);
   SET_VECTOR_ELT(res, 1, r_first_obs);
   
   // names
-  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index", "first_obs"}));
+  if(low_memory){
+    SET_VECTOR_ELT(res, 2, Rf_ScalarReal(mem.peak));
+    Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index", "first_obs", "peak_bytes"}));
+  } else {
+    Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index", "first_obs"}));
+  }
     
   UNPROTECT(3);
   
   return res;  
 }
 
+//
+// duplicates
+//
+
+enum {DUP_ANY, DUP_MASK, DUP_UNIQUE};
+
+void dense_ids_chunk(const vector<std::shared_ptr<r_vector>> &all_vecs, size_t i_start, 
+                     size_t n_chunk, int *__restrict p_id){
+  // all vectors are fast ints: p_id receives the position of the rows i_start to 
+  // i_start + n_chunk - 1 in the dense lookup table (see multiple_ints_to_index)
+  // the values are read column by column, with one loop per type
+  
+  std::fill_n(p_id, n_chunk, 0);
+  int offset = 0;
+  for(auto &&x : all_vecs){
+    const int NA_value = x->NA_value;
+    const int x_min = x->x_min;
+    if(x->type == T_INT){
+      const int *px = x->px_int + i_start;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        p_id[j] += (px[j] == NA_INTEGER ? NA_value : px[j] - x_min) << offset;
+      }
+    } else {
+      const double *px = x->px_dbl + i_start;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        p_id[j] += (std::isnan(px[j]) ? NA_value : static_cast<int>(px[j]) - x_min) << offset;
+      }
+    }
+    offset += x->x_range_bin;
+  }
+}
+
+void hash_rows_chunk(const vector<std::shared_ptr<r_vector>> &all_vecs, size_t i_start, 
+                     size_t n_chunk, uint32_t *__restrict p_hash, uint32_t seed){
+  // p_hash receives the hashes of the rows i_start to i_start + n_chunk - 1, 
+  // identical to hash_row
+  // the values are read column by column, with one loop per type
+  
+  std::fill_n(p_hash, n_chunk, 0);
+  for(auto &&x : all_vecs){
+    if(x->type == T_INT){
+      const int *px = x->px_int + i_start;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        p_hash[j] = 3141592653U * (p_hash[j] ^ static_cast<uint32_t>(px[j]));
+      }
+    } else if(x->type == T_INT64){
+      const int64_t *px = x->px_int64 + i_start;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        p_hash[j] = 3141592653U * (p_hash[j] ^ int64_to_uint32(px[j], seed));
+      }
+    } else if(x->type == T_DBL_INT){
+      const double *px = x->px_dbl + i_start;
+      const uint32_t NA_value = x->NA_value;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        const uint32_t v = std::isnan(px[j]) ? NA_value : static_cast<int>(px[j]);
+        p_hash[j] = 3141592653U * (p_hash[j] ^ v);
+      }
+    } else if(x->type == T_DBL){
+      const double *px = x->px_dbl + i_start;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        const uint32_t v = std::isnan(px[j]) ? 0 : double_to_uint32(px[j], seed);
+        p_hash[j] = 3141592653U * (p_hash[j] ^ v);
+      }
+    } else {
+      const intptr_t *px = x->px_intptr + i_start;
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        p_hash[j] = 3141592653U * (p_hash[j] ^ static_cast<uint32_t>(px[j] & 0xffffffff));
+      }
+    }
+  }
+  
+  if(seed != 0){
+    for(size_t j=0 ; j<n_chunk ; ++j){
+      p_hash[j] = mix_seed(p_hash[j], seed);
+    }
+  }
 }
 
-// export to R
+bool rows_duplicated(const vector<std::shared_ptr<r_vector>> &all_vecs, int mode, 
+                     int *p_mask, vector<int> &vec_first_obs, int &first_dup, 
+                     uint32_t seed, int max_probe){
+  // mode, p_mask, vec_first_obs: see cpp_duplicated_main (p_mask must be zeroed)
+  // first_dup: DUP_ANY mode, the first row (1-based) that is a duplicate of 
+  //            a previous row, 0 if none
+  // seed, max_probe: see general_type_to_index_single
+  // returns false if a probe was too long, in which case the results are invalid
+  // 
+  // The index engines process the vectors one after the other, each over all 
+  // the rows: a duplicated row is only known once the last vector is processed.
+  // Here the full rows are checked one at a time against a table of the rows 
+  // already seen: we stop at the first duplicate (DUP_ANY), and no index is 
+  // written (a row is a duplicate iff it is found in the table).
+  // The rows are processed by chunks: their table positions (dense lookup if all 
+  // vectors are fast ints) or their hashes are computed column by column with typed loops.
+  
+  const size_t n = all_vecs[0]->n;
+  const size_t chunk_size = 4096;
+  first_dup = 0;
+  
+  bool is_dense = true;
+  int sum_bin_ranges = 0;
+  for(auto &&x : all_vecs){
+    is_dense = is_dense && x->is_fast_int;
+    sum_bin_ranges += x->x_range_bin;
+  }
+  is_dense = is_dense && (sum_bin_ranges < 17 || sum_bin_ranges <= power_of_two(5.0 * n));
+  
+  if(is_dense){
+    
+    size_t lookup_size = std::pow(2, sum_bin_ranges);
+    vector<char> is_seen(lookup_size, 0);
+    int chunk[chunk_size];
+    
+    for(size_t i_start=0 ; i_start<n ; i_start += chunk_size){
+      const size_t n_chunk = std::min(chunk_size, n - i_start);
+      dense_ids_chunk(all_vecs, i_start, n_chunk, chunk);
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        const size_t i = i_start + j;
+        if(is_seen[chunk[j]]){
+          if(mode == DUP_ANY){
+            first_dup = i + 1;
+            return true;
+          } else if(mode == DUP_MASK){
+            p_mask[i] = 1;
+          }
+        } else {
+          is_seen[chunk[j]] = 1;
+          if(mode == DUP_UNIQUE){
+            vec_first_obs.push_back(i + 1);
+          }
+        }
+      }
+    }
+    
+    return true;
+  }
+  
+  int shifter = power_of_two(2.0 * n + 1.0);
+  if(shifter < 8) shifter = 8;
+  size_t larger_n = std::pow(2, shifter);
+  
+  vector<int> hashed_obs_vec(larger_n + 1, 0);
+  uint32_t chunk[chunk_size];
+  
+  uint32_t id = 0;
+  int obs = 0;
+  for(size_t i_start=0 ; i_start<n ; i_start += chunk_size){
+    const size_t n_chunk = std::min(chunk_size, n - i_start);
+    hash_rows_chunk(all_vecs, i_start, n_chunk, chunk, seed);
+    for(size_t j=0 ; j<n_chunk ; ++j){
+      chunk[j] >>= 32 - shifter;
+    }
+    
+    for(size_t j=0 ; j<n_chunk ; ++j){
+      const size_t i = i_start + j;
+      id = chunk[j];
+      
+      // the slots of the next rows are prefetched (see PROBE_BLOCK)
+      if(j + PROBE_BLOCK < n_chunk){
+        PREFETCH(hashed_obs_vec.data() + chunk[j + PROBE_BLOCK]);
+      }
+      
+      bool does_exist = false;
+      int n_probe = 0;
+      while(hashed_obs_vec[id] != 0){
+        obs = hashed_obs_vec[id] - 1;
+        if(is_same_row(all_vecs, obs, i)){
+          does_exist = true;
+          break;
+        }
+        
+        ++id;
+        if(id > larger_n){
+          id %= larger_n;
+        }
+        if(++n_probe == max_probe){
+          return false;
+        }
+      }
+      
+      if(does_exist){
+        if(mode == DUP_ANY){
+          first_dup = i + 1;
+          return true;
+        } else if(mode == DUP_MASK){
+          p_mask[i] = 1;
+        }
+      } else {
+        hashed_obs_vec[id] = i + 1;
+        if(mode == DUP_UNIQUE){
+          vec_first_obs.push_back(i + 1);
+        }
+      }
+    }
+  }
+  
+  return true;
+}
+
+int safe_rows_duplicated(const vector<std::shared_ptr<r_vector>> &all_vecs, int mode, 
+                         int *p_mask, vector<int> &vec_first_obs){
+  // see rows_duplicated and safe_type_to_index_single
+  
+  const size_t n = all_vecs[0]->n;
+  int first_dup = 0;
+  uint32_t seed = 0;
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(rows_duplicated(all_vecs, mode, p_mask, vec_first_obs, first_dup, seed, max_probe)){
+      break;
+    }
+    
+    if(p_mask){
+      std::fill_n(p_mask, n, 0);
+    }
+    vec_first_obs.clear();
+    seed = next_seed(seed, &first_dup, attempt);
+  }
+  
+  return first_dup;
+}
+
+int sorted_vector_duplicated(SEXP x, int mode, int *p_mask, vector<int> &vec_first_obs){
+  // x is known to be sorted => duplicates are contiguous, see sorted_vector_to_index
+  // mode, p_mask, vec_first_obs: see cpp_duplicated_main
+  // a single scan, without index: in DUP_ANY mode we stop at the first duplicate
+  
+  const size_t n = Rf_length(x);
+  const size_t chunk_size = 4096;
+  
+  if(TYPEOF(x) == INTSXP){
+    int chunk[chunk_size];
+    int previous = 0;
+    for(size_t i_start=0 ; i_start<n ; i_start += chunk_size){
+      size_t n_chunk = INTEGER_GET_REGION(x, i_start, chunk_size, chunk);
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        const size_t i = i_start + j;
+        if(i > 0 && chunk[j] == previous){
+          if(mode == DUP_ANY){
+            return i + 1;
+          } else if(mode == DUP_MASK){
+            p_mask[i] = 1;
+          }
+        } else if(mode == DUP_UNIQUE){
+          vec_first_obs.push_back(i + 1);
+        }
+        previous = chunk[j];
+      }
+    }
+  } else {
+    double chunk[chunk_size];
+    double previous = 0;
+    for(size_t i_start=0 ; i_start<n ; i_start += chunk_size){
+      size_t n_chunk = REAL_GET_REGION(x, i_start, chunk_size, chunk);
+      for(size_t j=0 ; j<n_chunk ; ++j){
+        const size_t i = i_start + j;
+        if(i > 0 && is_equal_dbl(chunk[j], previous)){
+          if(mode == DUP_ANY){
+            return i + 1;
+          } else if(mode == DUP_MASK){
+            p_mask[i] = 1;
+          }
+        } else if(mode == DUP_UNIQUE){
+          vec_first_obs.push_back(i + 1);
+        }
+        previous = chunk[j];
+      }
+    }
+  }
+  
+  return 0;
+}
+
+SEXP cpp_duplicated_main(SEXP x, int mode){
+  // x: list of vectors of the same length
+  // mode: 
+  // - DUP_ANY: returns the first duplicated row, 0 if none. We stop at the 
+  //            first duplicate, see rows_duplicated.
+  // - DUP_MASK: returns a logical vector, whether each row is a duplicate
+  // - DUP_UNIQUE: returns an integer vector of the first row of each group
+  // For a single vector, DUP_MASK and DUP_UNIQUE write only their result 
+  // (rows_duplicated): no index is created. With several vectors, they are 
+  // derived from the index, whose engines process the vectors one after the other.
+  
+  const size_t n = Rf_length(VECTOR_ELT(x, 0));
+  
+  // single sorted vector: duplicates are contiguous
+  SEXP x_single = Rf_length(x) == 1 ? VECTOR_ELT(x, 0) : R_NilValue;
+  if(is_known_sorted(x_single)){
+    SEXP res = R_NilValue;
+    vector<int> vec_first_obs;
+    if(mode == DUP_ANY){
+      res = PROTECT(Rf_ScalarInteger(sorted_vector_duplicated(x_single, mode, nullptr, vec_first_obs)));
+    } else if(mode == DUP_MASK){
+      res = PROTECT(Rf_allocVector(LGLSXP, n));
+      int *p_mask = LOGICAL(res);
+      std::fill_n(p_mask, n, 0);
+      sorted_vector_duplicated(x_single, mode, p_mask, vec_first_obs);
+    } else {
+      sorted_vector_duplicated(x_single, mode, nullptr, vec_first_obs);
+      const int g = vec_first_obs.size();
+      res = PROTECT(Rf_allocVector(INTSXP, g));
+      std::copy(vec_first_obs.begin(), vec_first_obs.end(), INTEGER(res));
+    }
+    
+    UNPROTECT(1);
+    return res;
+  }
+  
+  if(mode == DUP_ANY || Rf_length(x) == 1){
+    std::vector<std::shared_ptr<r_vector>> all_pvecs;
+    std::string error_msg;
+    if(list_to_r_vectors(x, all_pvecs, error_msg)){
+      return error_to_r_list(error_msg);
+    }
+    
+    vector<int> vec_first_obs;
+    SEXP res = R_NilValue;
+    if(mode == DUP_ANY){
+      res = PROTECT(Rf_ScalarInteger(safe_rows_duplicated(all_pvecs, mode, nullptr, vec_first_obs)));
+    } else if(mode == DUP_MASK){
+      res = PROTECT(Rf_allocVector(LGLSXP, n));
+      int *p_mask = LOGICAL(res);
+      std::fill_n(p_mask, n, 0);
+      safe_rows_duplicated(all_pvecs, mode, p_mask, vec_first_obs);
+    } else {
+      safe_rows_duplicated(all_pvecs, mode, nullptr, vec_first_obs);
+      const int g = vec_first_obs.size();
+      res = PROTECT(Rf_allocVector(INTSXP, g));
+      std::copy(vec_first_obs.begin(), vec_first_obs.end(), INTEGER(res));
+    }
+    
+    UNPROTECT(1);
+    return res;
+  }
+  
+  SEXP info = PROTECT(cpp_to_index_main(x));
+  if(Rf_length(info) != 2 || TYPEOF(VECTOR_ELT(info, 0)) != INTSXP){
+    // error: list(is_error, error_msg)
+    UNPROTECT(1);
+    return info;
+  }
+  
+  SEXP first_obs = VECTOR_ELT(info, 1);
+  if(mode == DUP_UNIQUE){
+    UNPROTECT(1);
+    return first_obs;
+  }
+  
+  // a row is a duplicate if it is not the first observation of its group
+  const int *p_index = INTEGER(VECTOR_ELT(info, 0));
+  const int *p_first_obs = INTEGER(first_obs);
+  SEXP res = PROTECT(Rf_allocVector(LGLSXP, n));
+  int *p_mask = LOGICAL(res);
+  for(size_t i=0 ; i<n ; ++i){
+    p_mask[i] = static_cast<size_t>(p_first_obs[p_index[i] - 1]) != i + 1;
+  }
+  
+  UNPROTECT(2);
+  
+  return res;
+}
+
+//
+// nested indexes
+//
+
+SEXP cpp_to_index_nested_main(SEXP x){
+  // x: list of K vectors of the same length (n)
+  // returns the indexes of all the prefixes of x: x[1], x[1:2], ..., x[1:K]
+  // - index: list of K vectors of length n
+  // - first_obs: list of K vectors, the first observation of each group
+  // - n_groups: vector of length K, the number of groups of each index
+  // 
+  // Each index is built from the previous one and one more vector, so the 
+  // cost is the same as for a single index of all the vectors. Contrary to 
+  // cpp_to_index_main, the vectors are processed in order.
+  
+  std::vector<std::shared_ptr<r_vector>> all_pvecs;
+  std::string error_msg;
+  if(list_to_r_vectors(x, all_pvecs, error_msg)){
+    return error_to_r_list(error_msg);
+  }
+  
+  const int K = Rf_length(x);
+  const size_t n = Rf_length(VECTOR_ELT(x, 0));
+  
+  SEXP all_index = PROTECT(Rf_allocVector(VECSXP, K));
+  SEXP all_first_obs = PROTECT(Rf_allocVector(VECSXP, K));
+  SEXP all_n_groups = PROTECT(Rf_allocVector(INTSXP, K));
+  
+  int n_groups = 0;
+  int *p_index_prev = nullptr;
+  for(int k=0 ; k<K ; ++k){
+    SEXP index = PROTECT(Rf_allocVector(INTSXP, n));
+    int *p_index = INTEGER(index);
+    std::vector<int> vec_first_obs;
+    
+    r_vector *xk = all_pvecs[k].get();
+    if(k > 0){
+      safe_type_to_index_double(xk, p_index_prev, p_index, n_groups, vec_first_obs, true, 0);
+    } else if(is_known_sorted(VECTOR_ELT(x, 0))){
+      sorted_vector_to_index(VECTOR_ELT(x, 0), p_index, n_groups, vec_first_obs);
+    } else if(xk->is_fast_int && xk->x_range_bin < 17){
+      vector<int> id_fast_int = {0};
+      multiple_ints_to_index(all_pvecs, id_fast_int, p_index, n_groups, vec_first_obs, true);
+    } else {
+      safe_type_to_index_single(xk, p_index, n_groups, vec_first_obs, true, 0);
+    }
+    
+    const int g = vec_first_obs.size();
+    SEXP r_first_obs = PROTECT(Rf_allocVector(INTSXP, g));
+    std::memcpy(INTEGER(r_first_obs), vec_first_obs.data(), sizeof(int) * g);
+    
+    SET_VECTOR_ELT(all_index, k, index);
+    SET_VECTOR_ELT(all_first_obs, k, r_first_obs);
+    INTEGER(all_n_groups)[k] = g;
+    UNPROTECT(2);
+    
+    p_index_prev = p_index;
+  }
+  
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(res, 0, all_index);
+  SET_VECTOR_ELT(res, 1, all_first_obs);
+  SET_VECTOR_ELT(res, 2, all_n_groups);
+  
+  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index", "first_obs", "n_groups"}));
+  
+  UNPROTECT(4);
+  
+  return res;
+}
+
+//
+// distinct counts within groups
+//
+
+SEXP cpp_n_distinct_main(SEXP x, SEXP by){
+  // x, by: lists of vectors, all of the same length
+  // returns: 
+  // - index: the index of by
+  // - first_obs: the first observations of the groups of by
+  // - n_distinct: for each group of by, the number of distinct values of x
+  // 
+  // The index of (by, x) is created from the index of by, the number of 
+  // distinct values is incremented each time a new (by, x) group is created.
+  
+  SEXP info = PROTECT(cpp_to_index_main(by));
+  if(Rf_length(info) != 2 || TYPEOF(VECTOR_ELT(info, 0)) != INTSXP){
+    // error: list(is_error, error_msg)
+    UNPROTECT(1);
+    return info;
+  }
+  
+  std::vector<std::shared_ptr<r_vector>> x_vecs;
+  std::string error_msg;
+  if(list_to_r_vectors(x, x_vecs, error_msg)){
+    UNPROTECT(1);
+    return error_to_r_list(error_msg);
+  }
+  
+  SEXP index = VECTOR_ELT(info, 0);
+  int *p_index_by = INTEGER(index);
+  const size_t n = Rf_length(index);
+  int n_groups = Rf_length(VECTOR_ELT(info, 1));
+  
+  group_counter counter;
+  counter.p_index = p_index_by;
+  counter.count.assign(n_groups, 0);
+  
+  // the indexes of (by, x1, ..., xk) are built successively
+  // the first observations are not needed
+  const int K = x_vecs.size();
+  vector<int> index_a(n), index_b(K > 1 ? n : 0);
+  vector<int> vec_first_obs;
+  int *p_index_in = p_index_by;
+  int *p_index_out = index_a.data();
+  for(int k=0 ; k<K ; ++k){
+    const bool is_last = k == K - 1;
+    safe_type_to_index_double(x_vecs[k].get(), p_index_in, p_index_out, n_groups, 
+                              vec_first_obs, false, 0, is_last ? &counter : nullptr);
+    
+    p_index_in = p_index_out;
+    p_index_out = p_index_out == index_a.data() ? index_b.data() : index_a.data();
+  }
+  
+  SEXP n_distinct = PROTECT(Rf_allocVector(INTSXP, counter.count.size()));
+  std::copy(counter.count.begin(), counter.count.end(), INTEGER(n_distinct));
+  
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(res, 0, index);
+  SET_VECTOR_ELT(res, 1, VECTOR_ELT(info, 1));
+  SET_VECTOR_ELT(res, 2, n_distinct);
+  
+  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index", "first_obs", "n_distinct"}));
+  
+  UNPROTECT(3);
+  
+  return res;
+}
+
+//
+// indexes of each vector
+//
+
+inline int get_thread_id(){
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+void single_vector_to_index(const std::shared_ptr<r_vector> &px, int *__restrict p_index, 
+                            int_buffer &table){
+  // same algorithms as cpp_to_index_main for a single vector
+  // no R API: can be run in parallel
+  // the first observations are not needed
+  
+  vector<std::shared_ptr<r_vector>> all_vecs = {px};
+  vector<int> vec_first_obs;
+  int n_groups = 0;
+  
+  if(px->is_fast_int && px->x_range_bin < 17){
+    vector<int> id_fast_int = {0};
+    multiple_ints_to_index(all_vecs, id_fast_int, p_index, n_groups, vec_first_obs, false, &table);
+  } else if(is_clustered_sample(all_vecs, px->n)){
+    safe_clustered_to_index(all_vecs, p_index, n_groups, vec_first_obs, 0);
+  } else {
+    safe_type_to_index_single(px.get(), p_index, n_groups, vec_first_obs, false, 0, &table);
+  }
+}
+
+SEXP cpp_to_index_each_main(SEXP x, int nthreads){
+  // x: list of vectors, possibly of different lengths
+  // nthreads: number of threads
+  // returns: list(index), index being the list of the indexes of each vector
+  // 
+  // The R objects which need the R API are handled in the main thread: the 
+  // allocation of the indexes, the sorted vectors, the conversions to character 
+  // and the ALTREP vectors (their data may be materialized).
+  // The other vectors are set up (range scan of r_vector) and indexed in parallel. 
+  // Since their costs vary, they are dynamically scheduled, largest first.
+  // Each thread reuses its own table across vectors.
+  
+  const int K = Rf_length(x);
+  
+  SEXP all_index = PROTECT(Rf_allocVector(VECSXP, K));
+  
+  std::vector<std::shared_ptr<r_vector>> all_pvecs(K);
+  vector<SEXP> all_x(K);
+  vector<int *> all_p_index(K);
+  vector<int> all_k_todo;
+  for(int k=0 ; k<K ; ++k){
+    SEXP xk = VECTOR_ELT(x, k);
+    all_x[k] = xk;
+    SEXP index = Rf_allocVector(INTSXP, Rf_length(xk));
+    SET_VECTOR_ELT(all_index, k, index);
+    all_p_index[k] = INTEGER(index);
+    
+    if(is_known_sorted(xk)){
+      int n_groups = 0;
+      vector<int> vec_first_obs;
+      sorted_vector_to_index(xk, all_p_index[k], n_groups, vec_first_obs);
+      continue;
+    }
+    
+    // the vectors of these types are never converted: their r_vector 
+    // only reads their data
+    bool is_plain = !ALTREP(xk) && (TYPEOF(xk) == INTSXP || TYPEOF(xk) == REALSXP || 
+                                    TYPEOF(xk) == LGLSXP || TYPEOF(xk) == STRSXP);
+    if(!is_plain){
+      all_pvecs[k] = std::make_shared<r_vector>(xk);
+      if(all_pvecs[k]->is_error){
+        UNPROTECT(1);
+        return error_to_r_list(all_pvecs[k]->error_msg);
+      }
+    }
+    
+    all_k_todo.push_back(k);
+  }
+  
+  std::stable_sort(all_k_todo.begin(), all_k_todo.end(), 
+                   [&all_x](int k1, int k2){ return Rf_length(all_x[k1]) > Rf_length(all_x[k2]); });
+  
+  const int n_todo = all_k_todo.size();
+  
+  // no more threads than available, or than vectors to index
+#ifdef _OPENMP
+  nthreads = std::min(nthreads, omp_get_max_threads());
+#else
+  nthreads = 1;
+#endif
+  nthreads = std::max(1, std::min(nthreads, n_todo));
+  
+  vector<int_buffer> all_tables(nthreads);
+  
+  // an exception escaping the parallel region would terminate the R session:
+  // the failures (allocations) are caught in the threads and reported afterwards
+  vector<char> is_failed(n_todo, 0);
+  
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+#endif
+  for(int t=0 ; t<n_todo ; ++t){
+    const int k = all_k_todo[t];
+    try {
+      if(!all_pvecs[k]){
+        all_pvecs[k] = std::make_shared<r_vector>(all_x[k]);
+      }
+      single_vector_to_index(all_pvecs[k], all_p_index[k], all_tables[get_thread_id()]);
+    } catch(...){
+      is_failed[t] = 1;
+    }
+  }
+  
+  for(int t=0 ; t<n_todo ; ++t){
+    if(is_failed[t]){
+      UNPROTECT(1);
+      return error_to_r_list("In `to_index_each`, the index of the vector " + 
+                             std::to_string(all_k_todo[t] + 1) + 
+                             " could not be created (not enough memory?).");
+    }
+  }
+  
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 1));
+  SET_VECTOR_ELT(res, 0, all_index);
+  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index"}));
+  
+  UNPROTECT(2);
+  
+  return res;
+}
+
+//
+// joins
+//
+
+// the keys of one side of a join, read in place (no copy)
+// ALTREP vectors without a data pointer (e.g. 1:n) are read element by element, 
+// they are not expanded
+class join_key {
+  join_key() = delete;
+  
+  SEXP x;
+  bool is_lgl = false;
+  const int *px_int = nullptr;
+  const double *px_dbl = nullptr;
+  const intptr_t *px_intptr = nullptr;
+  
+public:
+  int type = T_INT;
+  
+  join_key(SEXP x): x(x){
+    // x: logical, integer (incl. factors), double (incl. integer64) or character
+    if(TYPEOF(x) == STRSXP){
+      this->type = T_STR;
+      this->px_intptr = (const intptr_t *) STRING_PTR_RO(x);
+    } else if(TYPEOF(x) == REALSXP){
+      this->type = Rf_inherits(x, "integer64") ? T_INT64 : T_DBL;
+      this->px_dbl = (const double *) DATAPTR_OR_NULL(x);
+    } else {
+      this->is_lgl = TYPEOF(x) == LGLSXP;
+      this->px_int = (const int *) DATAPTR_OR_NULL(x);
+    }
+  }
+  
+  inline int int_value(size_t i) const {
+    if(px_int){
+      return px_int[i];
+    }
+    return is_lgl ? LOGICAL_ELT(x, i) : INTEGER_ELT(x, i);
+  }
+  
+  inline double dbl_value(size_t i) const {
+    return px_dbl ? px_dbl[i] : REAL_ELT(x, i);
+  }
+  
+  inline int64_t int64_value(size_t i) const {
+    const double value = dbl_value(i);
+    int64_t res;
+    std::memcpy(&res, &value, sizeof(res));
+    return res;
+  }
+  
+  inline uint32_t hash_value(size_t i, uint32_t seed) const {
+    // see value_to_uint32
+    if(type == T_INT){
+      return int_value(i);
+    } else if(type == T_INT64){
+      return int64_to_uint32(int64_value(i), seed);
+    } else if(type == T_DBL){
+      const double value = dbl_value(i);
+      return std::isnan(value) ? 0 : double_to_uint32(value, seed);
+    }
+    
+    return px_intptr[i] & 0xffffffff;
+  }
+  
+  inline void combine_hashes(size_t i_start, size_t n, uint32_t *p_hash, uint32_t seed) const {
+    // the hashes of the values i_start to i_start + n - 1 are combined 
+    // into p_hash, see hash_join_row
+    if(type == T_INT && px_int){
+      for(size_t j=0 ; j<n ; ++j){
+        p_hash[j] = 3141592653U * (p_hash[j] ^ static_cast<uint32_t>(px_int[i_start + j]));
+      }
+    } else if(type == T_STR){
+      for(size_t j=0 ; j<n ; ++j){
+        p_hash[j] = 3141592653U * (p_hash[j] ^ static_cast<uint32_t>(px_intptr[i_start + j] & 0xffffffff));
+      }
+    } else {
+      for(size_t j=0 ; j<n ; ++j){
+        p_hash[j] = 3141592653U * (p_hash[j] ^ hash_value(i_start + j, seed));
+      }
+    }
+  }
+  
+  inline bool is_same_value(size_t i, const join_key &y, size_t j) const {
+    // y must be of the same type
+    if(type == T_INT){
+      return int_value(i) == y.int_value(j);
+    } else if(type == T_INT64){
+      return int64_value(i) == y.int64_value(j);
+    } else if(type == T_DBL){
+      return is_equal_dbl(dbl_value(i), y.dbl_value(j));
+    }
+    
+    return px_intptr[i] == y.px_intptr[j];
+  }
+};
+
+inline uint32_t hash_join_row(const vector<join_key> &keys, size_t i, uint32_t seed){
+  // see hash_row
+  uint32_t value = 0;
+  for(auto &&key : keys){
+    value = 3141592653U * (value ^ key.hash_value(i, seed));
+  }
+  
+  return seed == 0 ? value : mix_seed(value, seed);
+}
+
+inline bool is_same_join_row(const vector<join_key> &keys_x, size_t i, 
+                             const vector<join_key> &keys_y, size_t j){
+  const size_t K = keys_x.size();
+  for(size_t k=0 ; k<K ; ++k){
+    if(!keys_x[k].is_same_value(i, keys_y[k], j)){
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+bool join_y_to_x(const vector<join_key> &keys_x, const int *p_first_obs_x, int g_x, 
+                 const vector<join_key> &keys_y, size_t n_y, int *__restrict p_index_y, 
+                 vector<int> &vec_first_obs_y, uint32_t seed, int max_probe){
+  // the distinct keys of x (their first observations: p_first_obs_x, 1-based) 
+  // are put in a table, then the rows of y are looked up in that table
+  // - p_index_y: receives the index of y in the common ID space, the groups of x 
+  //   having the IDs 1 to g_x and the new groups of y the IDs g_x + 1, etc
+  // - vec_first_obs_y: receives the first observations of the new groups of y
+  // seed, max_probe: see general_type_to_index_single
+  // returns false if a probe was too long, in which case the results are invalid
+  
+  // the table contains the IDs of the groups, 0 if empty
+  // its size is at least twice the number of groups: it grows with the new groups 
+  // of y (the number of distinct keys of y is unknown, it may be small)
+  int shifter = power_of_two(2.0 * g_x + 1.0);
+  if(shifter < 8) shifter = 8;
+  size_t mask = 0;
+  vector<int> table;
+  int *p_table = nullptr;
+  int g = g_x;
+  
+  auto fill_table = [&](){
+    // the groups are distinct: we only look for an empty slot
+    const size_t larger_n = static_cast<size_t>(1) << shifter;
+    mask = larger_n - 1;
+    table.assign(larger_n, 0);
+    p_table = table.data();
+    for(int group=1 ; group<=g ; ++group){
+      const uint32_t hash = group <= g_x ? 
+        hash_join_row(keys_x, p_first_obs_x[group - 1] - 1, seed) : 
+        hash_join_row(keys_y, vec_first_obs_y[group - g_x - 1] - 1, seed);
+      size_t id = hash >> (32 - shifter);
+      int n_probe = 0;
+      while(p_table[id] != 0){
+        id = (id + 1) & mask;
+        if(max_probe > 0 && ++n_probe > max_probe){
+          return false;
+        }
+      }
+      p_table[id] = group;
+    }
+    
+    return true;
+  };
+  
+  if(!fill_table()){
+    return false;
+  }
+  
+  // the rows of y, by blocks (see PROBE_BLOCK)
+  // the hashes of a block are computed key by key
+  uint32_t block_hash[PROBE_BLOCK];
+  size_t block_id[PROBE_BLOCK];
+  for(size_t i_start=0 ; i_start<n_y ; i_start += PROBE_BLOCK){
+    const size_t i_end = std::min(n_y, i_start + PROBE_BLOCK);
+    const size_t n_block = i_end - i_start;
+    
+    std::fill_n(block_hash, n_block, 0);
+    for(auto &&key : keys_y){
+      key.combine_hashes(i_start, n_block, block_hash, seed);
+    }
+    
+    for(size_t b=0 ; b<n_block ; ++b){
+      const uint32_t hash = seed == 0 ? block_hash[b] : mix_seed(block_hash[b], seed);
+      block_id[b] = hash >> (32 - shifter);
+      PREFETCH(p_table + block_id[b]);
+    }
+    
+    for(size_t i=i_start ; i<i_end ; ++i){
+      size_t id = block_id[i - i_start];
+      int n_probe = 0;
+      while(true){
+        const int group = p_table[id];
+        if(group == 0){
+          // new group
+          p_table[id] = ++g;
+          vec_first_obs_y.push_back(i + 1);
+          p_index_y[i] = g;
+          
+          if(2 * static_cast<size_t>(g) > mask + 1){
+            // the table is too full: it is doubled, the slots of the rest 
+            // of the block change
+            ++shifter;
+            if(!fill_table()){
+              return false;
+            }
+            
+            for(size_t j=i + 1 ; j<i_end ; ++j){
+              block_id[j - i_start] = hash_join_row(keys_y, j, seed) >> (32 - shifter);
+            }
+          }
+          break;
+        }
+        
+        const bool is_same = group <= g_x ? 
+          is_same_join_row(keys_x, p_first_obs_x[group - 1] - 1, keys_y, i) : 
+          is_same_join_row(keys_y, vec_first_obs_y[group - g_x - 1] - 1, keys_y, i);
+        if(is_same){
+          p_index_y[i] = group;
+          break;
+        }
+        
+        id = (id + 1) & mask;
+        if(max_probe > 0 && ++n_probe > max_probe){
+          return false;
+        }
+      }
+    }
+  }
+  
+  return true;
+}
+
+SEXP cpp_to_index_join_main(SEXP x, SEXP y){
+  // x, y: lists of vectors, the same number in each, all vectors in x (resp. y) 
+  //       are of the same length. The vectors in position k in x and y must be of 
+  //       the same type.
+  // returns:
+  // - index_x, index_y: the indexes of x and y in a common ID space, as if 
+  //                     we indexed the concatenation of x and y
+  // - x_only, y_only: logical vectors of length the number of groups, whether 
+  //                   the group appears only in x (resp. y)
+  // 
+  // Algorithm: 
+  // 1) x is indexed with the regular engines, its groups get the IDs 1 to g_x
+  // 2) the distinct keys of x are put in a table, the rows of y are looked up 
+  //    in it: they get the IDs of x or new IDs in order of occurrence (join_y_to_x)
+  // Nothing is concatenated, and y is hashed only once.
+  
+  const int K = Rf_length(x);
+  for(int k=0 ; k<K ; ++k){
+    SEXP xk = VECTOR_ELT(x, k);
+    SEXP yk = VECTOR_ELT(y, k);
+    bool is_same_type = TYPEOF(xk) == TYPEOF(yk) && 
+                          Rf_isFactor(xk) == Rf_isFactor(yk) &&
+                          Rf_inherits(xk, "integer64") == Rf_inherits(yk, "integer64");
+    if(!is_same_type){
+      return error_to_r_list("In `to_index_join`, the keys of `x` and `y` must be of the same type.");
+    }
+    
+    bool is_valid_type = TYPEOF(xk) == LGLSXP || TYPEOF(xk) == INTSXP || TYPEOF(xk) == REALSXP || 
+                           TYPEOF(xk) == STRSXP || TYPEOF(xk) == CPLXSXP || TYPEOF(xk) == RAWSXP;
+    if(!is_valid_type){
+      return error_to_r_list("In `to_index_join`, the keys must be atomic. The current type is not valid.");
+    }
+  }
+  
+  // the complex and raw keys are turned into character, as in r_vector
+  SEXP x_keys = PROTECT(Rf_allocVector(VECSXP, K));
+  SEXP y_keys = PROTECT(Rf_allocVector(VECSXP, K));
+  for(int k=0 ; k<K ; ++k){
+    for(int side=0 ; side<2 ; ++side){
+      SEXP src = VECTOR_ELT(side == 0 ? x : y, k);
+      SEXP dest = side == 0 ? x_keys : y_keys;
+      if(TYPEOF(src) == CPLXSXP || TYPEOF(src) == RAWSXP){
+        int any_error;
+        SEXP src_conv = R_tryEval(Rf_lang2(Rf_install("as.character"), src), R_GlobalEnv, &any_error);
+        if(any_error){
+          UNPROTECT(2);
+          return error_to_r_list("In `to_index_join`, the keys failed to be converted to character.");
+        }
+        SET_VECTOR_ELT(dest, k, src_conv);
+      } else {
+        SET_VECTOR_ELT(dest, k, src);
+      }
+    }
+  }
+  
+  SEXP info_x = PROTECT(cpp_to_index_main(x_keys));
+  if(Rf_length(info_x) != 2 || TYPEOF(VECTOR_ELT(info_x, 0)) != INTSXP){
+    // error: list(is_error, error_msg)
+    UNPROTECT(3);
+    return info_x;
+  }
+  
+  SEXP index_x = VECTOR_ELT(info_x, 0);
+  SEXP first_obs_x = VECTOR_ELT(info_x, 1);
+  const int *p_first_obs_x = INTEGER(first_obs_x);
+  const int g_x = Rf_length(first_obs_x);
+  
+  const size_t n_y = K == 0 ? 0 : Rf_length(VECTOR_ELT(y_keys, 0));
+  vector<join_key> all_keys_x, all_keys_y;
+  for(int k=0 ; k<K ; ++k){
+    all_keys_x.push_back(join_key(VECTOR_ELT(x_keys, k)));
+    all_keys_y.push_back(join_key(VECTOR_ELT(y_keys, k)));
+    if((size_t) Rf_length(VECTOR_ELT(y_keys, k)) != n_y){
+      UNPROTECT(3);
+      return error_to_r_list("All the vectors to turn into an index must be of the same length. This is currently not the case.");
+    }
+  }
+  
+  SEXP index_y = PROTECT(Rf_allocVector(INTSXP, n_y));
+  int *p_index_y = INTEGER(index_y);
+  
+  // see safe_type_to_index_single
+  vector<int> vec_first_obs_y;
+  uint32_t seed = 0;
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(join_y_to_x(all_keys_x, p_first_obs_x, g_x, all_keys_y, n_y, p_index_y, 
+                   vec_first_obs_y, seed, max_probe)){
+      break;
+    }
+    
+    vec_first_obs_y.clear();
+    seed = next_seed(seed, p_index_y, attempt);
+  }
+  
+  const int g = g_x + vec_first_obs_y.size();
+  
+  // which side each group comes from: 1 x only, 2 y only, 3 both
+  vector<int> vec_group_side(g, 2);
+  std::fill_n(vec_group_side.begin(), g_x, 1);
+  for(size_t i=0 ; i<n_y ; ++i){
+    if(p_index_y[i] <= g_x){
+      vec_group_side[p_index_y[i] - 1] = 3;
+    }
+  }
+  
+  SEXP x_only = PROTECT(Rf_allocVector(LGLSXP, g));
+  SEXP y_only = PROTECT(Rf_allocVector(LGLSXP, g));
+  int *p_x_only = LOGICAL(x_only);
+  int *p_y_only = LOGICAL(y_only);
+  for(int i=0 ; i<g ; ++i){
+    p_x_only[i] = vec_group_side[i] == 1;
+    p_y_only[i] = vec_group_side[i] == 2;
+  }
+  
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(res, 0, index_x);
+  SET_VECTOR_ELT(res, 1, index_y);
+  SET_VECTOR_ELT(res, 2, x_only);
+  SET_VECTOR_ELT(res, 3, y_only);
+  
+  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index_x", "index_y", "x_only", "y_only"}));
+  
+  UNPROTECT(7);
+  
+  return res;
+}
+
+//
+// raw UTF-8 strings
+//
+
+// Strings which are not R strings yet (e.g. coming from a file reader) can be 
+// indexed without creating a CHARSXP for each element, which requires a lookup 
+// in R's global cache. They are stored Arrow-style: a buffer of bytes and 
+// the offsets of the strings, the i-th string spanning data[offsets[i]] to 
+// data[offsets[i + 1] - 1].
+// 
+// Since the strings are not interned, they are compared by content: 
+// - they are hashed 8 bytes at a time
+// - two strings are equal if they have the same length, the same hash and memcmp agrees
+// Only the items are turned into R strings: one CHARSXP per group.
+
+inline uint32_t hash_bytes(const unsigned char *p, size_t len, uint32_t seed = 0){
+  // word at a time hashing, the last word being padded with zeros
+  // the final avalanche (fmix64 from murmur3) is required since we use the high bits
+  // seed: changes the initial state, hence the collisions
+  
+  uint64_t h = (0x9e3779b97f4a7c15ULL + seed) ^ (len * 0xc6a4a7935bd1e995ULL);
+  uint64_t w = 0;
+  size_t i = 0;
+  for( ; i + 8 <= len ; i += 8){
+    std::memcpy(&w, p + i, 8);
+    h ^= w * 0x87c37b91114253d5ULL;
+    h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+  }
+  
+  if(i < len){
+    w = 0;
+    std::memcpy(&w, p + i, len - i);
+    h ^= w * 0x87c37b91114253d5ULL;
+    h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+  }
+  
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  
+  return (uint32_t) h;
+}
+
+bool utf8_to_index(const unsigned char *data, const int *offsets, const int *p_na, 
+                   size_t n, int *__restrict p_index, int &n_groups, 
+                   vector<int> &vec_first_obs, uint32_t seed, int max_probe){
+  // data: buffer of bytes
+  // offsets: n + 1 offsets of the strings in data, must be non decreasing
+  // p_na: null, or n flags of missing values (all missing values share the same group)
+  // n_groups, vec_first_obs: see cpp_to_index_main
+  // seed, max_probe: see general_type_to_index_single
+  // returns false if a probe was too long, in which case the index is invalid
+  
+  int shifter = power_of_two(2.0 * n + 1.0);
+  if(shifter < 8) shifter = 8;
+  const size_t larger_n = std::pow(2, shifter);
+  
+  // the table contains obs + 1 (0 means empty), and the full hash of that obs
+  // so that memcmp is only done on genuine matches
+  vector<int> hashed_obs_vec(larger_n, 0);
+  vector<uint32_t> table_hash(larger_n);
+  
+  // the hashes of the current block of rows (see PROBE_BLOCK)
+  uint32_t block_hash[PROBE_BLOCK];
+  
+  int g = 0;
+  int g_na = 0;
+  for(size_t i_start=0 ; i_start<n ; i_start += PROBE_BLOCK){
+    const size_t i_end = std::min(n, i_start + PROBE_BLOCK);
+    
+    for(size_t i=i_start ; i<i_end ; ++i){
+      const uint32_t h = hash_bytes(data + offsets[i], offsets[i + 1] - offsets[i], seed);
+      block_hash[i - i_start] = h;
+      PREFETCH(hashed_obs_vec.data() + (h >> (32 - shifter)));
+    }
+    
+    for(size_t i=i_start ; i<i_end ; ++i){
+      if(p_na && p_na[i]){
+        if(g_na == 0){
+          g_na = ++g;
+          vec_first_obs.push_back(i + 1);
+        }
+        p_index[i] = g_na;
+        continue;
+      }
+      
+      const uint32_t h = block_hash[i - i_start];
+      const int len = offsets[i + 1] - offsets[i];
+      size_t id = h >> (32 - shifter);
+      
+      bool does_exist = false;
+      int n_probe = 0;
+      while(hashed_obs_vec[id] != 0){
+        const int obs = hashed_obs_vec[id] - 1;
+        if(table_hash[id] == h && offsets[obs + 1] - offsets[obs] == len && 
+           std::memcmp(data + offsets[obs], data + offsets[i], len) == 0){
+          p_index[i] = p_index[obs];
+          does_exist = true;
+          break;
+        }
+        
+        if(++id == larger_n){
+          id = 0;
+        }
+        if(++n_probe == max_probe){
+          return false;
+        }
+      }
+      
+      if(!does_exist){
+        hashed_obs_vec[id] = i + 1;
+        table_hash[id] = h;
+        p_index[i] = ++g;
+        vec_first_obs.push_back(i + 1);
+      }
+    }
+  }
+  
+  n_groups = g;
+  
+  return true;
+}
+
+void safe_utf8_to_index(const unsigned char *data, const int *offsets, const int *p_na, 
+                        size_t n, int *__restrict p_index, int &n_groups, 
+                        vector<int> &vec_first_obs){
+  // see safe_type_to_index_single
+  
+  uint32_t seed = 0;
+  for(int attempt=0 ; attempt<3 ; ++attempt){
+    const int max_probe = attempt < 2 ? MAX_PROBE_LENGTH : 0;
+    if(utf8_to_index(data, offsets, p_na, n, p_index, n_groups, vec_first_obs, seed, max_probe)){
+      return;
+    }
+    
+    vec_first_obs.clear();
+    seed = next_seed(seed, p_index, attempt);
+  }
+}
+
+SEXP cpp_to_index_utf8_main(SEXP data, SEXP offsets, SEXP na, bool items){
+  // data: raw vector
+  // offsets: integer vector of length n + 1, 0-based
+  // na: NULL or logical vector of length n
+  // items: whether to return the strings of the groups
+  // returns: list(index, first_obs, items), items being NULL if not requested
+  
+  const size_t n = Rf_length(offsets) - 1;
+  const int *p_offsets = INTEGER(offsets);
+  const int n_data = Rf_length(data);
+  
+  const int *p_na = Rf_isNull(na) ? nullptr : LOGICAL(na);
+  
+  if(p_offsets[0] < 0 || p_offsets[n] > n_data){
+    return error_to_r_list("In `to_index_utf8`, the offsets must lie within the data: between 0 and the number of bytes.");
+  }
+  
+  for(size_t i=0 ; i<n ; ++i){
+    if(p_offsets[i + 1] < p_offsets[i]){
+      return error_to_r_list("In `to_index_utf8`, the offsets must be non decreasing.\nPROBLEM: offset " + 
+                             std::to_string(i + 2) + " is lower than offset " + 
+                             std::to_string(i + 1) + ".");
+    }
+  }
+  
+  const unsigned char *p_data = RAW(data);
+  
+  SEXP index = PROTECT(Rf_allocVector(INTSXP, n));
+  
+  int n_groups = 0;
+  vector<int> vec_first_obs;
+  safe_utf8_to_index(p_data, p_offsets, p_na, n, INTEGER(index), n_groups, vec_first_obs);
+  
+  SEXP first_obs = PROTECT(Rf_allocVector(INTSXP, n_groups));
+  std::copy(vec_first_obs.begin(), vec_first_obs.end(), INTEGER(first_obs));
+  
+  SEXP r_items = PROTECT(items ? Rf_allocVector(STRSXP, n_groups) : R_NilValue);
+  if(items){
+    for(int g=0 ; g<n_groups ; ++g){
+      const int i = vec_first_obs[g] - 1;
+      if(p_na && p_na[i]){
+        SET_STRING_ELT(r_items, g, NA_STRING);
+      } else {
+        const char *p_str = (const char *) p_data + p_offsets[i];
+        SET_STRING_ELT(r_items, g, Rf_mkCharLenCE(p_str, p_offsets[i + 1] - p_offsets[i], CE_UTF8));
+      }
+    }
+  }
+  
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(res, 0, index);
+  SET_VECTOR_ELT(res, 1, first_obs);
+  SET_VECTOR_ELT(res, 2, r_items);
+  
+  Rf_setAttrib(res, R_NamesSymbol, std_string_to_r_string({"index", "first_obs", "items"}));
+  
+  UNPROTECT(4);
+  
+  return res;
+}
+
+}
+
+// export to R
+
+extern "C" SEXP _indexthis_cpp_to_index(SEXP x, SEXP clustered, SEXP low_memory, SEXP seed, 
+                                        SEXP subset, SEXP bin_width, SEXP bin_digits){
+  return indexthis::cpp_to_index_main(x, Rf_asLogical(clustered), Rf_asLogical(low_memory) == TRUE, 
+                                      Rf_asInteger(seed), subset, bin_width, bin_digits);
+}
+
+extern "C" SEXP _indexthis_cpp_lazy_subset(SEXP x, SEXP pos){
+  return indexthis::cpp_lazy_subset_main(x, pos);
+}
+
+extern "C" SEXP _indexthis_cpp_duplicated(SEXP x, SEXP mode){
+  return indexthis::cpp_duplicated_main(x, Rf_asInteger(mode));
+}
+
+extern "C" SEXP _indexthis_cpp_to_index_each(SEXP x, SEXP nthreads){
+  return indexthis::cpp_to_index_each_main(x, Rf_asInteger(nthreads));
+}
+
+extern "C" SEXP _indexthis_cpp_n_distinct(SEXP x, SEXP by){
+  return indexthis::cpp_n_distinct_main(x, by);
+}
+
+extern "C" SEXP _indexthis_cpp_to_index_nested(SEXP x){
+  return indexthis::cpp_to_index_nested_main(x);
+}
+
+extern "C" SEXP _indexthis_cpp_to_index_join(SEXP x, SEXP y){
+  return indexthis::cpp_to_index_join_main(x, y);
+}
 
-extern "C" SEXP _indexthis_cpp_to_index(SEXP x){
-  return indexthis::cpp_to_index_main(x);
+extern "C" SEXP _indexthis_cpp_to_index_utf8(SEXP data, SEXP offsets, SEXP na, SEXP items){
+  return indexthis::cpp_to_index_utf8_main(data, offsets, na, Rf_asLogical(items) == TRUE);
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_indexthis_cpp_to_index", (DL_FUNC) &_indexthis_cpp_to_index, 1},
+    {"_indexthis_cpp_to_index", (DL_FUNC) &_indexthis_cpp_to_index, 7},
+    {"_indexthis_cpp_lazy_subset", (DL_FUNC) &_indexthis_cpp_lazy_subset, 2},
+    {"_indexthis_cpp_duplicated", (DL_FUNC) &_indexthis_cpp_duplicated, 2},
+    {"_indexthis_cpp_n_distinct", (DL_FUNC) &_indexthis_cpp_n_distinct, 2},
+    {"_indexthis_cpp_to_index_nested", (DL_FUNC) &_indexthis_cpp_to_index_nested, 1},
+    {"_indexthis_cpp_to_index_each", (DL_FUNC) &_indexthis_cpp_to_index_each, 2},
+    {"_indexthis_cpp_to_index_join", (DL_FUNC) &_indexthis_cpp_to_index_join, 2},
+    {"_indexthis_cpp_to_index_utf8", (DL_FUNC) &_indexthis_cpp_to_index_utf8, 4},
     {NULL, NULL, 0}
 };
 
 extern "C" void R_init_indexthis(DllInfo *dll) {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    indexthis::init_lazy_subset_classes(dll);
 }
 